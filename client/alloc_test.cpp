@@ -0,0 +1,151 @@
+// alloc_test.cpp
+// Check that the receive path does not allocate: warm up one download flow, then feed it new chunks,
+// duplicates and replies out of the ACK window through a loopback socket and count operator new in
+// flow_receive. Exits with 1 if any allocation is seen.
+// Build: g++ -std=c++17 -O2 -pthread alloc_test.cpp -o alloc_test
+#define COUNT_ALLOCATIONS
+#define CLIENT_NO_MAIN
+#include "client.cpp"
+
+#define TEST_CHUNK_SIZE 1024
+#define TEST_CHUNKS 4096
+#define TEST_ROUNDS 64
+#define TEST_NEW 16            // Datagrams of each round: new chunks,
+#define TEST_DUPLICATES 8      // chunks already received,
+#define TEST_OUT_OF_WINDOW 8   // chunks with a seq past the ACK window
+#define TEST_BUFFERS (TEST_NEW * 2)     // Pool of a warm writer: room for every new chunk of a round
+
+/// @brief Data of a test chunk, the same on every call
+void test_chunk(uint64_t chunk_id, char* data) {
+    for (size_t i = 0; i < TEST_CHUNK_SIZE; i++) {
+        data[i] = (char)(chunk_id * 31 + i);
+    }
+}
+
+/// @brief UDP socket bound to an ephemeral loopback port, its address in addr
+int test_socket(int sock, sockaddr_in& addr) {
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(sock, (const sockaddr*)&addr, sizeof(addr)) < 0 || getsockname(sock, (sockaddr*)&addr, &len) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    return sock;
+}
+
+/// @brief Wait until the writer has written everything queued and given every buffer back
+void wait_writer(ChunkWriter& writer) {
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(writer.mtx);
+            if (writer.queue.empty() && writer.free_buffers.size() >= TEST_BUFFERS) {
+                return;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+int main() {
+    init_crc_table();
+    init_sha256();
+
+    // Server side: sends the replies, ACKs of the flow go to a socket nobody reads
+    sockaddr_in sender_addr, flow_addr, sink_addr;
+    int sender = test_socket(socket(AF_INET, SOCK_DGRAM, 0), sender_addr);
+    int sink = test_socket(socket(AF_INET, SOCK_DGRAM, 0), sink_addr);
+    mirrors.assign(1, sink_addr);
+
+    // One download of TEST_CHUNKS chunks on one flow, every chunk requested
+    Download download;
+    download.filename = "alloc_test";
+    download.metadata.chunk_size = TEST_CHUNK_SIZE;
+    download.metadata.num_chunks = TEST_CHUNKS;
+    download.metadata.file_size = (uint64_t)TEST_CHUNK_SIZE * TEST_CHUNKS;
+    download.chunk_hashes.resize(TEST_CHUNKS);
+    char data[TEST_CHUNK_SIZE];
+    for (uint64_t chunk_id = 0; chunk_id < TEST_CHUNKS; chunk_id++) {
+        test_chunk(chunk_id, data);
+        download.chunk_hashes[chunk_id] = merkle_leaf(data, TEST_CHUNK_SIZE);
+    }
+    download.inflated.resize(TEST_CHUNK_SIZE + 2 * sizeof(uint64_t));
+    ChunkScheduler& scheduler = download.scheduler;
+    scheduler.total_chunk = TEST_CHUNKS;
+    scheduler.missing_chunk = TEST_CHUNKS;
+    scheduler.received.assign(TEST_CHUNKS, false);
+
+    std::unique_ptr<CongestionController> cc = make_congestion_controller(CONGESTION_CONTROL);
+    download.flows = std::vector<DownloadFlow>(1);
+    DownloadFlow& flow = download.flows[0];
+    flow.sock = test_socket(create_socket(), flow_addr);
+    flow.file_handle = 1;
+    flow.cc = cc.get();
+    for (uint64_t chunk_id = 0; chunk_id < TEST_CHUNKS; chunk_id++) {
+        flow.requested[chunk_id] = {std::chrono::steady_clock::now(), false, false};
+    }
+    flow.in_flight = TEST_CHUNKS;
+
+    // Writer to a removed temporary file, with the buffers a running download has in its pool
+    ChunkWriter& writer = download.writer;
+    char path[] = "/tmp/alloc_test.XXXXXX";
+    writer.fd = mkstemp(path);
+    if (writer.fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    writer.journal.num_chunks = TEST_CHUNKS;
+    writer.journal.bitmap.assign((TEST_CHUNKS + 7) / 8, 0);
+    writer.chunk_size = TEST_CHUNK_SIZE;
+    writer.threaded = true;
+    writer.queue.reserve(WRITE_QUEUE_BYTES / TEST_CHUNK_SIZE + 1);
+    for (int i = 0; i < TEST_BUFFERS; i++) {
+        writer.free_buffers.emplace_back(TEST_CHUNK_SIZE);
+    }
+    writer.thread = std::thread(chunk_writer_thread, std::ref(writer));
+
+    // Round 0 warms the flow up (first ACKs, congestion controller), the others are counted
+    std::vector<char> buffer(MAX_PACKET_SIZE);
+    char datagram[MAX_PACKET_SIZE];
+    uint64_t next_chunk = 0, seq = 0, allocations = 0, datagrams = 0;
+    for (int round = 0; round <= TEST_ROUNDS; round++) {
+        auto send_chunk = [&](uint64_t chunk_id) {
+            test_chunk(chunk_id, data);
+            size_t len = build_packet(datagram, OP_CHUNK, flow.file_handle, chunk_id, seq++, data, TEST_CHUNK_SIZE);
+            sendto(sender, datagram, len, 0, (const sockaddr*)&flow_addr, sizeof(flow_addr));
+        };
+        for (int i = 0; i < TEST_NEW; i++) {
+            send_chunk(next_chunk++);
+        }
+        for (int i = 0; i < TEST_DUPLICATES; i++) {
+            send_chunk(next_chunk - 1 - i);
+        }
+        for (int i = 0; i < TEST_OUT_OF_WINDOW; i++) {
+            seq += ACK_RING;
+            send_chunk(next_chunk - 1 - i);
+        }
+
+        receive_allocations = 0;
+        flow_receive(download, flow, buffer);
+        if (round > 0) {
+            allocations += receive_allocations;
+            datagrams += TEST_NEW + TEST_DUPLICATES + TEST_OUT_OF_WINDOW;
+        }
+        wait_writer(writer);
+    }
+    chunk_writer_close(download.writer);
+    close(flow.sock);
+    close(sender);
+    close(sink);
+
+    uint64_t received = TEST_NEW * (TEST_ROUNDS + 1);
+    if (scheduler.missing_chunk != TEST_CHUNKS - received) {
+        std::cout << "FAIL: " << TEST_CHUNKS - scheduler.missing_chunk << " chunks received, " << received << " sent\n";
+        return 1;
+    }
+    std::cout << (allocations == 0 ? "OK" : "FAIL") << ": " << allocations << " allocations for " << datagrams
+              << " datagrams\n";
+    return allocations == 0 ? 0 : 1;
+}
@@ -1,4 +1,5 @@
 #include "client.h"
+#include "../common/crc32.h"
 
 /// @brief To use to manage sent packets status
 struct PendingPacket {
@@ -7,16 +8,45 @@ struct PendingPacket {
     char buffer[BUFFER_SIZE];
     size_t buffer_len;
     bool needs_retry; // Add flag to manage retry
+    int pending_waits; // Times the server answered it is still hashing the file
 };
 
-static uint32_t crc_table[256];             // CRC32 table (2^8=256)
-std::atomic<bool> running{true};           // Flag to control thread
-std::mutex packets_mtx;                   // Mutex for syncing
-std::condition_variable timeout_cv;      // Condition variable
-std::vector<PendingPacket> pending_packets;
-struct sockaddr_in server_addr;
+std::atomic<int> downloading{0};           // Download loops running: Ctrl+C stops them cleanly instead of exiting
+std::atomic<bool> interrupted{false};      // Ctrl+C received during a download
+std::atomic<int> active_downloads{0};      // Files being downloaded, BANDWIDTH_LIMIT is split between them
+BandwidthBudget bandwidth_budget;
+std::mutex metadata_rtt_mtx;
+RttEstimator metadata_rtt{RETRY_DELAY_MS, MIN_RTO_MS, MAX_RTO_MS};  // Metadata round trips of every group
+std::mutex metadata_cache_mtx;
+std::unordered_map<std::string, CachedMetadata> metadata_cache;    // Filename => what the last catalog said
+std::mutex console_mtx;                    // Progress blocks of parallel downloads must not interleave
+
+#ifdef COUNT_ALLOCATIONS
+// Build with -DCOUNT_ALLOCATIONS to check that receiving does not allocate: every operator new of a thread is
+// counted, flow_receive adds what it allocated to receive_allocations (shown and reset with the progress)
+thread_local uint64_t thread_allocations = 0;
+std::atomic<uint64_t> receive_allocations{0};
+std::atomic<uint64_t> received_datagrams{0};
+
+void* operator new(size_t size) {
+    thread_allocations++;
+    if (void* ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+#endif
+struct sockaddr_in server_addr;                 // Main server: catalog, metadata and chunk hashes
 socklen_t server_addr_len = sizeof(server_addr);
-std::chrono::_V2::steady_clock::time_point last_seen = std::chrono::steady_clock::now();
+std::vector<sockaddr_in> mirrors;               // Servers chunks are downloaded from, mirrors[0] = server_addr
 
 uint64_t ntohll(uint64_t value) {
     return (((uint64_t)ntohl(value & 0xFFFFFFFF)) << 32) | ntohl(value >> 32); 
@@ -32,166 +62,606 @@ void empty_lines(int height = CONSOLE_HEIGHT) {
     }
 }
 
-/// @brief create CRC32 looking table using 0xEDB88320 polynomial
-void init_crc_table() {
-    uint32_t polynomial = 0xEDB88320;
-    for (uint32_t i = 0; i < 256; i++) {
-        uint32_t c = i;
-        for (size_t j = 0; j < 8; j++) {
-            if (c & 1)
-                c = polynomial ^ (c >> 1);
-            else
-                c = c >> 1;
+/// @brief Build a datagram (header + payload) into message, return its total length
+size_t build_packet(char* message, uint8_t opcode, uint32_t file_handle, uint64_t chunk_id, uint64_t seq,
+                    const char* payload, size_t payload_len, uint16_t flags = 0) {
+    PacketHeader header;
+    header.version = PROTOCOL_VERSION;
+    header.opcode = opcode;
+    header.flags = htons(flags);
+    header.file_handle = htonl(file_handle);
+    header.chunk_id = htonll(chunk_id);
+    header.seq = htonll(seq);
+    header.length = htonl(payload_len);
+    header.crc = 0;
+
+    memcpy(message, &header, sizeof(header));
+    if (payload_len > 0) {
+        memcpy(message + sizeof(header), payload, payload_len);
+    }
+    size_t total_len = sizeof(header) + payload_len;
+
+    uint32_t crc = htonl(crc32(message, total_len));
+    memcpy(message + offsetof(PacketHeader, crc), &crc, sizeof(crc));
+    return total_len;
+}
+
+/// @brief Check version, length and CRC of a datagram, fill header in host order. Return false if it must be dropped
+bool parse_packet(char* message, size_t len, PacketHeader& header) {
+    if (len < sizeof(PacketHeader)) {
+        return false;
+    }
+    memcpy(&header, message, sizeof(header));
+    if (header.version != PROTOCOL_VERSION || sizeof(header) + ntohl(header.length) != len) {
+        return false;
+    }
+
+    // CRC is computed with its own field zeroed
+    uint32_t crc_received = ntohl(header.crc);
+    memset(message + offsetof(PacketHeader, crc), 0, sizeof(header.crc));
+    if (crc32(message, len) != crc_received) {
+        return false;
+    }
+
+    header.flags = ntohs(header.flags);
+    header.file_handle = ntohl(header.file_handle);
+    header.chunk_id = ntohll(header.chunk_id);
+    header.seq = ntohll(header.seq);
+    header.length = ntohl(header.length);
+    return true;
+}
+
+/// @brief Hàm gửi ACK: mọi gói có số thứ tự < cumulative, cộng bitmap SACK (bit i => cumulative + 1 + i)
+void send_ack(int sock, const sockaddr_in& server, uint64_t cumulative, const char* sack, size_t sack_len) {
+    char ack_buffer[sizeof(PacketHeader) + SACK_BITMAP_BYTES];
+    size_t ack_len = build_packet(ack_buffer, OP_ACK, 0, 0, cumulative, sack, sack_len);
+
+    sendto(sock, ack_buffer, ack_len, 0, (const sockaddr*)&server, sizeof(server));
+    //std::cout << "Đã gửi ACK #" << cumulative << " đến server\n";
+}
+
+/// @brief Move the cumulative ACK to new_cumulative: seqs below it are forgotten
+void ack_slide(AckState& acks, uint64_t new_cumulative) {
+    for (uint64_t seq = acks.cumulative; seq < new_cumulative && acks.received_count > 0; seq++) {
+        if (acks.received.test(seq % ACK_RING)) {
+            acks.received.reset(seq % ACK_RING);
+            acks.received_count--;
         }
-        crc_table[i] = c;
     }
+    acks.cumulative = new_cumulative;
 }
 
-/// @brief calculate crc32 checksum for a string data
-uint32_t crc32(char* buf, size_t len) {
-    uint32_t crc = 0xFFFFFFFF;
-    for (size_t i = 0; i < len; i++) {
-        uint8_t index = (crc ^ (uint8_t)buf[i]) & 0xFF;
-        crc = crc_table[index] ^ (crc >> 8);
+/// @brief Remember a reply seq as received, without counting a datagram (reply rebuilt or not needed)
+void ack_mark(AckState& acks, uint64_t seq) {
+    if (seq < acks.cumulative) {
+        return;     // Duplicate, the next ACK tells the server again
+    }
+
+    // The bitmap covers SACK_BITMAP_BYTES * 8 seqs: older holes are given up
+    if (seq - acks.cumulative > SACK_BITMAP_BYTES * 8) {
+        ack_slide(acks, seq - SACK_BITMAP_BYTES * 8);
+    }
+    if (!acks.received.test(seq % ACK_RING)) {
+        acks.received.set(seq % ACK_RING);
+        acks.received_count++;
     }
-    return crc ^ 0xFFFFFFFF;
 }
 
-/// @brief decode and remove checksum to original message, return True if crc checking is similar
-bool decode_and_popback(char* message, size_t& len) {
-    uint32_t crc_calculated = htonl(crc32(message, len - 4));
-    uint32_t crc_received;
-    memcpy(&crc_received, message + len - 4, sizeof(crc_received));
-    len -= sizeof(crc_received);
-    message[len] = '\0';
+/// @brief Remember a received reply seq, the ACK goes out later (ACK_EVERY datagrams or DELAYED_ACK_MS)
+void ack_record(AckState& acks, uint64_t seq, std::chrono::steady_clock::time_point now) {
+    if (acks.unacked++ == 0) {
+        acks.first_unacked = now;
+    }
+    ack_mark(acks, seq);
+}
+
+/// @brief Send the ACK of a socket to its server: cumulative part + SACK bitmap of what is received above it
+void ack_send(int sock, const sockaddr_in& server, AckState& acks, std::chrono::steady_clock::time_point now) {
+    // A hole the server gave up on must not block the cumulative ACK
+    if (acks.received_count > 0 && !acks.received.test(acks.cumulative % ACK_RING)
+        && now - acks.last_advance > std::chrono::milliseconds(ACK_HOLE_TIMEOUT_MS)) {
+        uint64_t lowest = acks.cumulative + 1;
+        while (!acks.received.test(lowest % ACK_RING)) {
+            lowest++;
+        }
+        acks.cumulative = lowest;
+    }
+
+    // Advance over everything received in order
+    while (acks.received.test(acks.cumulative % ACK_RING)) {
+        acks.received.reset(acks.cumulative % ACK_RING);
+        acks.received_count--;
+        acks.cumulative++;
+        acks.last_advance = now;
+    }
 
-    return (crc_received == crc_calculated);
+    char sack[SACK_BITMAP_BYTES] = {0};
+    size_t sack_len = 0;
+    for (uint64_t bit = 0; bit < SACK_BITMAP_BYTES * 8 && acks.received_count > 0; bit++) {
+        if (acks.received.test((acks.cumulative + 1 + bit) % ACK_RING)) {
+            sack[bit / 8] |= 1 << (bit % 8);
+            sack_len = bit / 8 + 1;
+        }
+    }
+    send_ack(sock, server, acks.cumulative, sack, sack_len);
+    acks.unacked = 0;
 }
 
-/// @brief Hàm gửi ACK (có thể cần điều chỉnh hoặc loại bỏ tùy thuộc vào server)
-void send_ack(int sock, uint64_t seq_num) {
-    char ack_buffer[BUFFER_SIZE];
-    snprintf(ack_buffer, sizeof(ack_buffer), "REPLY:%lu:ACK", seq_num);
-    
-    sendto(sock, ack_buffer, strlen(ack_buffer), 0, (const sockaddr*)&server_addr, server_addr_len);
-    //std::cout << "Đã gửi ACK #" << seq_num << " đến server\n";
+/// @brief Chunk size to ask the server for: the largest payload that fits the path MTU without IP fragmentation
+uint32_t request_chunk_size() {
+    if (CHUNK_SIZE_OVERRIDE > 0) {
+        return CHUNK_SIZE_OVERRIDE;
+    }
+
+    // Connected UDP socket knows the MTU of the route to server
+    int mtu = 1500;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock >= 0) {
+        socklen_t mtu_len = sizeof(mtu);
+        if (connect(sock, (const sockaddr*)&server_addr, sizeof(server_addr)) < 0
+            || getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &mtu_len) < 0) {
+            mtu = 1500;
+        }
+        close(sock);
+    }
+
+    // IPv4 header + UDP header + our header
+    int chunk_size = mtu - 20 - 8 - (int)sizeof(PacketHeader);
+    return std::max(0, std::min(chunk_size, MAX_CHUNK_SIZE));
 }
 
-void resend_packet_thread(int client_sock) {
-    while(running) {
-        auto now = std::chrono::steady_clock::now();
+std::string journal_path(const std::string& filename) {
+    return DOWNLOADS_DIR + filename + JOURNAL_SUFFIX;
+}
 
-        {   
-            std::unique_lock<std::mutex> lock(packets_mtx);
+/// @brief A journal exists: the download of this file was interrupted
+bool journal_exists(const std::string& filename) {
+    struct stat st;
+    return stat(journal_path(filename).c_str(), &st) == 0;
+}
 
-            for (PendingPacket& packet: pending_packets) {
-                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - packet.send_time);
+/// @brief Read the header of an existing journal, false if there is none or it is not valid
+bool journal_read_header(int fd, JournalHeader& header) {
+    return pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+        && memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0
+        && header.version == JOURNAL_VERSION;
+}
 
-                if(elapsed.count() > RETRY_DELAY_MS) {
-                    // Resend packet
-                    sendto(client_sock, packet.buffer, packet.buffer_len, 0,
-                            (sockaddr*)&server_addr, server_addr_len);
+/// @brief Chunk size an interrupted download was started with, 0 if there is no journal
+uint32_t journal_chunk_size(const std::string& filename) {
+    int fd = open(journal_path(filename).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    JournalHeader header;
+    uint32_t chunk_size = journal_read_header(fd, header) ? (uint32_t)header.chunk_size : 0;
+    close(fd);
+    return chunk_size;
+}
 
-                    packet.send_time = now;
-                    std::cout << "[RESEND]: " << packet.buffer << "\n"; 
-                }
+/// @brief Open the journal of a download. Returns true when it resumes an interrupted download:
+/// same metadata and the downloaded file is still there. Otherwise starts a new, empty journal
+bool journal_open(DownloadJournal& journal, std::string filename, const Metadata& metadata) {
+    journal.path = journal_path(filename);
+    journal.num_chunks = metadata.num_chunks;
+    journal.bitmap.assign((metadata.num_chunks + 7) / 8, 0);
+    journal.written_chunk = 0;
+    journal.dirty_begin = SIZE_MAX;
+    journal.dirty_end = 0;
+    journal.last_flush = std::chrono::steady_clock::now();
+    journal.fd = open(journal.path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (journal.fd < 0) {
+        std::cerr << "Không thể tạo journal, không thể tiếp tục tải nếu bị dừng: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    JournalHeader header;
+    struct stat st;
+    if (journal_read_header(journal.fd, header)
+        && header.file_size == metadata.file_size && header.num_chunks == metadata.num_chunks
+        && header.chunk_size == metadata.chunk_size
+        && memcmp(header.root_hash, metadata.root_hash, SHA256_SIZE) == 0
+        && stat((DOWNLOADS_DIR + filename).c_str(), &st) == 0 && (uint64_t)st.st_size == metadata.file_size
+        && pread(journal.fd, journal.bitmap.data(), journal.bitmap.size(), sizeof(header)) == (ssize_t)journal.bitmap.size()) {
+        for (uint8_t byte : journal.bitmap) {
+            journal.written_chunk += __builtin_popcount(byte);
+        }
+        return true;
+    }
+
+    // New download (or the file changed on the server): empty bitmap
+    std::fill(journal.bitmap.begin(), journal.bitmap.end(), 0);
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.file_size = metadata.file_size;
+    header.num_chunks = metadata.num_chunks;
+    header.chunk_size = metadata.chunk_size;
+    memcpy(header.root_hash, metadata.root_hash, SHA256_SIZE);
+    if (ftruncate(journal.fd, 0) < 0 || pwrite(journal.fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || ftruncate(journal.fd, sizeof(header) + journal.bitmap.size()) < 0) {
+        std::cerr << "Không thể ghi journal: " << strerror(errno) << std::endl;
+    }
+    return false;
+}
+
+bool journal_has(const DownloadJournal& journal, uint64_t chunk_id) {
+    return journal.bitmap[chunk_id / 8] & (1 << (chunk_id % 8));
+}
+
+/// @brief A chunk has been written to the downloaded file (recorded at the next flush)
+void journal_mark(DownloadJournal& journal, uint64_t chunk_id) {
+    if (journal_has(journal, chunk_id)) {
+        return;
+    }
+    size_t byte = chunk_id / 8;
+    journal.bitmap[byte] |= 1 << (chunk_id % 8);
+    journal.written_chunk++;
+    journal.dirty_begin = std::min(journal.dirty_begin, byte);
+    journal.dirty_end = std::max(journal.dirty_end, byte + 1);
+}
+
+/// @brief A chunk recorded in the journal turned out to be wrong on disk: it is downloaded again
+void journal_unmark(DownloadJournal& journal, uint64_t chunk_id) {
+    if (!journal_has(journal, chunk_id)) {
+        return;
+    }
+    size_t byte = chunk_id / 8;
+    journal.bitmap[byte] &= ~(1 << (chunk_id % 8));
+    journal.written_chunk--;
+    journal.dirty_begin = std::min(journal.dirty_begin, byte);
+    journal.dirty_end = std::max(journal.dirty_end, byte + 1);
+}
+
+/// @brief Check every chunk the journal of a resumed download claims against its hash, on VERIFY_THREADS
+/// threads reading the mapped file. Wrong chunks are unmarked; return how many
+uint64_t journal_verify(DownloadJournal& journal, const std::string& filename, const Metadata& metadata,
+                        const std::vector<Sha256Hash>& chunk_hashes) {
+    int fd = open((DOWNLOADS_DIR + filename).c_str(), O_RDONLY);
+    if (fd < 0 || metadata.file_size == 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    void* mapped = mmap(nullptr, metadata.file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror("Không thể đọc file để kiểm tra");
+        return 0;
+    }
+    const char* data = (const char*)mapped;
+
+    unsigned threads = VERIFY_THREADS ? VERIFY_THREADS : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::vector<uint64_t>> corrupted(threads);
+    auto verify_range = [&](unsigned part) {
+        for (uint64_t chunk_id = part; chunk_id < metadata.num_chunks; chunk_id += threads) {
+            if (!journal_has(journal, chunk_id)) {
+                continue;
+            }
+            uint64_t offset = chunk_id * metadata.chunk_size;
+            size_t len = std::min<uint64_t>(metadata.chunk_size, metadata.file_size - offset);
+            if (merkle_leaf(data + offset, len) != chunk_hashes[chunk_id]) {
+                corrupted[part].push_back(chunk_id);
             }
         }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned part = 1; part < threads; part++) {
+        workers.emplace_back(verify_range, part);
+    }
+    verify_range(0);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    munmap(mapped, metadata.file_size);
 
-        // Wait with timeout
-        std::unique_lock<std::mutex> lock(packets_mtx);
-        timeout_cv.wait_for(lock, std::chrono::milliseconds(RETRY_DELAY_MS), [&]{
-            return !running.load();
-        });
+    uint64_t count = 0;
+    for (std::vector<uint64_t>& chunks : corrupted) {
+        for (uint64_t chunk_id : chunks) {
+            journal_unmark(journal, chunk_id);
+            count++;
+        }
     }
+    return count;
 }
 
-struct Metadata get_metadata(std::string filename) {
-    running = true;
-    std::cout << "Metadata " << filename << "\n";
-    Metadata file_downloading;
-    char buffer[BUFFER_SIZE];
-    size_t recv_len;
+/// @brief Record the chunks marked since the last flush. Their data is synced first, so the journal
+/// never claims a chunk that a crash could still lose
+void journal_flush(DownloadJournal& journal, int data_fd) {
+    journal.last_flush = std::chrono::steady_clock::now();
+    if (journal.fd < 0 || journal.dirty_begin >= journal.dirty_end) {
+        return;
+    }
+    if (fdatasync(data_fd) < 0) {
+        perror("Không thể đồng bộ file");
+        return;
+    }
+    size_t len = journal.dirty_end - journal.dirty_begin;
+    if (pwrite(journal.fd, journal.bitmap.data() + journal.dirty_begin, len, sizeof(JournalHeader) + journal.dirty_begin) != (ssize_t)len) {
+        perror("Không thể ghi journal");
+        return;
+    }
+    journal.dirty_begin = SIZE_MAX;
+    journal.dirty_end = 0;
+}
+
+/// @brief Flush and close the journal, remove it once every chunk is written
+void journal_close(DownloadJournal& journal, int data_fd) {
+    if (journal.fd < 0) {
+        return;
+    }
+    if (journal.written_chunk == journal.num_chunks) {
+        fdatasync(data_fd);
+        unlink(journal.path.c_str());
+    } else {
+        journal_flush(journal, data_fd);
+    }
+    close(journal.fd);
+    journal.fd = -1;
+}
+
+/// @brief Every chunk hash of a download has been received: they must give the root hash of its metadata
+bool hash_tree_valid(const Download& download) {
+    Sha256Hash root;
+    memcpy(root.data(), download.metadata.root_hash, SHA256_SIZE);
+    return merkle_root(download.chunk_hashes) == root;
+}
+
+/// @brief RTO of a metadata, hash or catalog request resent retry_count times
+std::chrono::microseconds metadata_rto(int retry_count) {
+    std::lock_guard<std::mutex> lock(metadata_rtt_mtx);
+    return std::chrono::microseconds((int64_t)(metadata_rtt.rto_ms(retry_count) * 1000));
+}
+
+/// @brief A metadata, hash or catalog request sent once was answered
+void metadata_rtt_sample(std::chrono::steady_clock::time_point send_time, std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lock(metadata_rtt_mtx);
+    metadata_rtt.sample(std::chrono::duration<double, std::milli>(now - send_time).count());
+}
+
+/// @brief Get the metadata of several files on one socket at once: from the catalog cache, or asked for
+/// together, then the chunk hashes of each file (METADATA_WINDOW requests in flight), checked against the
+/// root hash of its metadata. Unanswered requests are resent after the metadata RTO (doubled at each retry),
+/// at most MAX_RETRIES times; downloads with metadata and verified chunk hashes get has_metadata
+void get_metadata(std::vector<std::unique_ptr<Download>>& downloads) {
+    char buffer[MAX_PACKET_SIZE];
     int client_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    std::string message = REQUEST_METADATA + (std::string)":" + filename;
 
     if (client_sock < 0) {
         std::cerr << "Lỗi tạo socket" << std::endl;
         exit(0);
     }
 
-    PendingPacket meta_request;
-    strcpy(meta_request.buffer, message.c_str());
-    meta_request.buffer_len = message.size();
-    meta_request.send_time = std::chrono::steady_clock::now();
-    pending_packets.clear();                    // Empty pending queue to send only this meta packet
-    pending_packets.push_back(meta_request);    // Supposed we sent the first time and then push to wait for resend
-
-    std::thread timeout_thread(resend_packet_thread, client_sock);
-    while(true) {
-        // Load from socket...
-        recv_len = recvfrom(client_sock, buffer, BUFFER_SIZE - 1, 0,
-                                    (struct sockaddr*)&server_addr, &server_addr_len);
-        buffer[recv_len] = '\0';
-
-        if(recv_len > 0) {
-            decode_and_popback(buffer, recv_len);
-            message = buffer;
-            std::cout << "[RECEIVED]: " << message << "\n";
-            
-            // List file metadata pattern
-            std::string pattern = R"(^REPLY:\d+:META:)" + filename + R"(:.*$)"; 
-
-            std::regex regex_pattern(pattern);   
-            if (std::regex_match(message, regex_pattern)) {   // If matches then check data
-                char *token = strtok(buffer, ":");  // REPLY
-                token = strtok(NULL, ":");          // seq#
-                uint64_t seq_num = std::stoull(token);
-                token = strtok(NULL, ":");          // META
-                token = strtok(NULL, ":");          // filename
-
-                size_t data_len = recv_len - ((size_t)(token - &buffer[0]) + strlen(token) + 1);
-                Metadata net_meta;
-
-                if (data_len == sizeof(Metadata)) {            // If data matches then parse and break the loop
-                    memcpy(&net_meta, token + strlen(token) + 1, sizeof(Metadata));
-                    file_downloading.file_size = ntohll(net_meta.file_size);
-                    file_downloading.num_chunks = ntohll(net_meta.num_chunks);
-                    file_downloading.chunk_size = ntohll(net_meta.chunk_size);
-                    std::cout << "\n--- Metadata ---\n"
-                            << "File: " << filename << "\n"
-                            << "Kích thước: " << file_downloading.file_size << " bytes\n"
-                            << "Số chunk: " << file_downloading.num_chunks << "\n"
-                            << "Kích thước chunk: " << file_downloading.chunk_size << " bytes\n"
-                            << "----------------\n";
-
-                    send_ack(client_sock, seq_num);
-                    running = false;
+    // (download index, first leaf) => its request, METADATA_REQUEST for the metadata itself
+    const uint64_t METADATA_REQUEST = UINT64_MAX;
+    std::map<std::pair<size_t, uint64_t>, PendingPacket> pending;
+    std::deque<std::pair<size_t, uint64_t>> hash_queue;     // Hash requests not sent yet
+    size_t hashes_in_flight = 0;
+
+    auto send_request = [&](std::pair<size_t, uint64_t> key, uint8_t opcode, uint32_t file_handle, uint64_t chunk_id,
+                            const char* payload, size_t payload_len, uint16_t flags) {
+        PendingPacket& request = pending[key];
+        request.buffer_len = build_packet(request.buffer, opcode, file_handle, chunk_id, 0, payload, payload_len, flags);
+        request.send_time = std::chrono::steady_clock::now();
+        request.retry_count = 0;
+        request.pending_waits = 0;
+        sendto(client_sock, request.buffer, request.buffer_len, 0, (const sockaddr*)&server_addr, server_addr_len);
+    };
+
+    // A download that failed: forget its requests
+    auto give_up = [&](size_t index) {
+        for (auto it = pending.lower_bound({index, 0}); it != pending.end() && it->first.first == index;) {
+            hashes_in_flight -= it->first.second != METADATA_REQUEST;
+            it = pending.erase(it);
+        }
+        hash_queue.erase(std::remove_if(hash_queue.begin(), hash_queue.end(),
+                                        [&](const auto& key) { return key.first == index; }), hash_queue.end());
+    };
+
+    // Chunk hashes of a download whose metadata is known: one leaf is the root itself, else verified
+    // hashes from the cache, else asked for, as many per reply as fit one chunk
+    auto queue_hashes = [&](size_t index) {
+        Download& download = *downloads[index];
+        download.missing_hashes = 0;
+        if (download.metadata.num_chunks <= 1) {
+            download.chunk_hashes.assign(download.metadata.num_chunks, Sha256Hash{});
+            if (download.metadata.num_chunks == 1) {
+                memcpy(download.chunk_hashes[0].data(), download.metadata.root_hash, SHA256_SIZE);
+            }
+            download.has_metadata = hash_tree_valid(download);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(metadata_cache_mtx);
+            auto cached = metadata_cache.find(download.filename);
+            if (cached != metadata_cache.end() && cached->second.file_handle == download.file_handle
+                && cached->second.chunk_hashes.size() == download.metadata.num_chunks
+                && memcmp(cached->second.metadata.root_hash, download.metadata.root_hash, SHA256_SIZE) == 0) {
+                download.chunk_hashes = cached->second.chunk_hashes;
+                download.has_metadata = true;
+                return;
+            }
+        }
+        download.chunk_hashes.assign(download.metadata.num_chunks, Sha256Hash{});
+        download.missing_hashes = download.metadata.num_chunks;
+        uint64_t per_reply = std::max<uint64_t>(1, download.metadata.chunk_size / SHA256_SIZE);
+        for (uint64_t first = 0; first < download.metadata.num_chunks; first += per_reply) {
+            hash_queue.emplace_back(index, first);
+        }
+    };
+
+    // Verified chunk hashes are kept for the next download of the same version
+    auto cache_hashes = [&](const Download& download) {
+        std::lock_guard<std::mutex> lock(metadata_cache_mtx);
+        auto cached = metadata_cache.find(download.filename);
+        if (cached != metadata_cache.end() && cached->second.file_handle == download.file_handle
+            && memcmp(cached->second.metadata.root_hash, download.metadata.root_hash, SHA256_SIZE) == 0) {
+            cached->second.chunk_hashes = download.chunk_hashes;
+        }
+    };
+
+    // Payload: requested chunk size + filename
+    uint32_t default_chunk_size = request_chunk_size();
+    for (size_t index = 0; index < downloads.size(); index++) {
+        Download& download = *downloads[index];
+        std::string& filename = download.filename;
+        char payload[sizeof(uint32_t) + MAX_FILENAME_LENGTH];
+
+        // A resumed download keeps the chunk size its journal was built with
+        uint32_t journal_chunk = journal_chunk_size(filename);
+        uint32_t wanted_chunk_size = journal_chunk ? journal_chunk : default_chunk_size;
+
+        // Listed in the catalog (asked for with the default size, which the server may round down) or with
+        // the chunk size of the journal: no round trip
+        {
+            std::lock_guard<std::mutex> lock(metadata_cache_mtx);
+            auto cached = metadata_cache.find(filename);
+            if (cached != metadata_cache.end() && (journal_chunk == 0 || cached->second.metadata.chunk_size == journal_chunk)) {
+                download.metadata = cached->second.metadata;
+                download.file_handle = cached->second.file_handle;
+                download.mirror_handles = cached->second.mirror_handles;
+            }
+        }
+        if (download.file_handle != 0) {
+            queue_hashes(index);
+            continue;
+        }
+
+        uint32_t chunk_size = htonl(wanted_chunk_size);
+        size_t name_len = std::min(filename.size(), (size_t)MAX_FILENAME_LENGTH);
+        memcpy(payload, &chunk_size, sizeof(chunk_size));
+        memcpy(payload + sizeof(chunk_size), filename.data(), name_len);
+        send_request({index, METADATA_REQUEST}, OP_REQUEST_METADATA, 0, 0, payload, sizeof(chunk_size) + name_len, COMPRESSION);
+    }
+
+    AckState acks;
+    while ((!pending.empty() || !hash_queue.empty()) && !interrupted) {
+        // Keep METADATA_WINDOW hash requests in flight
+        while (hashes_in_flight < METADATA_WINDOW && !hash_queue.empty()) {
+            auto key = hash_queue.front();
+            hash_queue.pop_front();
+            send_request(key, OP_REQUEST_HASHES, downloads[key.first]->file_handle, key.second, nullptr, 0, 0);
+            hashes_in_flight++;
+        }
+
+        // Sleep until the first retry is due
+        auto next_retry = std::chrono::steady_clock::time_point::max();
+        for (auto& [key, packet] : pending) {
+            next_retry = std::min(next_retry, packet.send_time + metadata_rto(packet.retry_count));
+        }
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(next_retry - std::chrono::steady_clock::now());
+        struct pollfd pfd = {client_sock, POLLIN, 0};
+        int ready = poll(&pfd, 1, std::max<int>(0, wait.count()));
+        auto now = std::chrono::steady_clock::now();
+
+        PacketHeader header;
+        ssize_t recv_len = ready > 0 ? recv(client_sock, buffer, sizeof(buffer), 0) : -1;
+        if (recv_len > 0 && parse_packet(buffer, recv_len, header)) {
+            char* payload = buffer + sizeof(PacketHeader);
+
+            // Every reply (old chunks too) is acknowledged so server stops resending it, errors are sent once
+            if (header.seq != NO_SEQ) {
+                ack_record(acks, header.seq, now);
+                ack_send(client_sock, server_addr, acks, now);
+            }
+
+            // Metadata reply: Metadata + filename, filename must be one requested
+            if (header.opcode == OP_META && header.length >= sizeof(Metadata)) {
+                std::string filename(payload + sizeof(Metadata), header.length - sizeof(Metadata));
+                for (auto it = pending.begin(); it != pending.end(); ++it) {
+                    Download& download = *downloads[it->first.first];
+                    if (it->first.second != METADATA_REQUEST || download.filename != filename) {
+                        continue;
+                    }
+
+                    // Not hashed yet: asked again after CATALOG_PENDING_WAIT_MS (resent, so no RTT sample from it)
+                    if (header.flags & META_PENDING) {
+                        if (++it->second.pending_waits > CATALOG_PENDING_RETRIES) {
+                            std::cerr << "Server chưa tính xong mã băm của " << filename << std::endl;
+                            give_up(it->first.first);
+                        } else {
+                            it->second.send_time = now + std::chrono::milliseconds(CATALOG_PENDING_WAIT_MS);
+                            it->second.retry_count = 1;
+                        }
+                        break;
+                    }
+                    Metadata net_meta;
+                    memcpy(&net_meta, payload, sizeof(Metadata));
+                    download.metadata.file_size = ntohll(net_meta.file_size);
+                    download.metadata.num_chunks = ntohll(net_meta.num_chunks);
+                    download.metadata.chunk_size = ntohll(net_meta.chunk_size);
+                    memcpy(download.metadata.root_hash, net_meta.root_hash, SHA256_SIZE);
+                    download.file_handle = header.file_handle;
+                    download.mirror_handles.assign(1, header.file_handle);     // Not in the catalog: main server only
+
+                    // Karn: only a request sent once gives an RTT sample
+                    if (it->second.retry_count == 0) {
+                        metadata_rtt_sample(it->second.send_time, now);
+                    }
+                    std::cout << "Metadata " << filename << ": " << download.metadata.file_size << " bytes, "
+                              << download.metadata.num_chunks << " chunk x " << download.metadata.chunk_size << " bytes\n";
+
+                    // Then its chunk hashes
+                    size_t index = it->first.first;
+                    pending.erase(it);
+                    queue_hashes(index);
+                    break;
+                }
+            } else if (header.opcode == OP_HASHES && header.length % SHA256_SIZE == 0) {
+                // Leaf hashes: stored once, the tree is checked when the last ones arrive
+                for (auto it = pending.begin(); it != pending.end(); ++it) {
+                    Download& download = *downloads[it->first.first];
+                    if (it->first.second != header.chunk_id || download.file_handle != header.file_handle
+                        || header.chunk_id + header.length / SHA256_SIZE > download.chunk_hashes.size()) {
+                        continue;
+                    }
+                    if (it->second.retry_count == 0) {
+                        metadata_rtt_sample(it->second.send_time, now);
+                    }
+                    for (uint64_t i = 0; i < header.length / SHA256_SIZE; i++) {
+                        memcpy(download.chunk_hashes[header.chunk_id + i].data(), payload + i * SHA256_SIZE, SHA256_SIZE);
+                    }
+                    download.missing_hashes -= header.length / SHA256_SIZE;
+                    size_t index = it->first.first;
+                    pending.erase(it);
+                    hashes_in_flight--;
+                    if (download.missing_hashes == 0) {
+                        download.has_metadata = hash_tree_valid(download);
+                        if (download.has_metadata) {
+                            cache_hashes(download);
+                        } else {
+                            std::cerr << "Mã băm của " << download.filename << " không khớp với metadata" << std::endl;
+                            give_up(index);
+                        }
+                    }
                     break;
                 }
+            } else if (header.opcode == OP_ERROR && pending.size() == 1 && hash_queue.empty()) {
+                // Errors do not name the file: only the last request left can be told it failed
+                std::cerr << "Server từ chối " << downloads[pending.begin()->first.first]->filename << ": "
+                          << std::string(payload, header.length) << std::endl;
+                pending.clear();
+            }
+        }
+
+        for (auto it = pending.begin(); it != pending.end();) {
+            PendingPacket& packet = it->second;
+            if (now - packet.send_time < metadata_rto(packet.retry_count)) {
+                ++it;
+            } else if (packet.retry_count >= MAX_RETRIES) {
+                size_t index = it->first.first;
+                std::cerr << "Không lấy được metadata của " << downloads[index]->filename << std::endl;
+                give_up(index);
+                it = pending.upper_bound({index, METADATA_REQUEST});
+            } else {
+                sendto(client_sock, packet.buffer, packet.buffer_len, 0, (const sockaddr*)&server_addr, server_addr_len);
+                packet.send_time = now;
+                packet.retry_count++;
+                std::cout << "[RESEND]\n";
+                ++it;
             }
         }
-        timeout_cv.notify_one();
     }
 
-    // Clean up
-    timeout_cv.notify_all();
-    timeout_thread.join();
     close(client_sock);
-    return file_downloading;
-}
-
-std::string uint64_to_string_converter(uint64_t num) {
-    std::string tmp = "";
-    while(num > 0) {
-        tmp += (char)(num % 10 + '0');
-        num /= 10;
-    }
-    if (tmp.size() == 0) {
-        tmp = "0";
-    }
-    std::reverse(tmp.begin(), tmp.end());
-    return tmp;
 }
 
 int create_socket() {
@@ -207,209 +677,996 @@ int create_socket() {
     // Đặt socket ở chế độ non-blocking
     fcntl(client_sock, F_SETFL, O_NONBLOCK);
 
+    // Let the kernel coalesce chunks of the same flow (UDP GRO), not supported on old kernels
+    int gro = 1;
+    setsockopt(client_sock, SOL_UDP, UDP_GRO, &gro, sizeof(gro));
+
+    // Room for a whole window of replies (capped by net.core.rmem_max)
+    int rcvbuf = SOCKET_RCVBUF_SIZE;
+    setsockopt(client_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
     return client_sock;
 }
 
 void createFileWithSize(std::string filename, uint64_t size) {
     filename = DOWNLOADS_DIR + filename;
-    std::lock_guard<std::mutex> lock(packets_mtx);
 
     // Mở file với chế độ ghi và tạo mới
-    std::ofstream out(filename, std::ios::binary);
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    if (!out) {
+    if (fd < 0) {
         std::cerr << "Không thể mở file để ghi!" << std::endl;
         return;
     }
 
-    // Ghi đủ dữ liệu (khoảng trắng) để đạt được kích thước mong muốn
-    char filler = '\0';  // Ký tự để điền vào file
-    for (uint64_t i = 0; i < size; ++i) {
-        out.put(filler);  // Ghi ký tự filler vào file
+    // Only metadata is written: start time does not depend on file size
+    int ret = -1;
+    if (PREALLOCATE_MODE == PREALLOCATE_RESERVE && size > 0) {
+        // Reserve blocks now so the download can not fail on a full disk midway
+        ret = fallocate(fd, 0, 0, size);
+        if (ret < 0 && errno != EOPNOTSUPP) {
+            std::cerr << "Không đủ dung lượng đĩa: " << strerror(errno) << std::endl;
+        }
+    }
+    if (ret < 0 && ftruncate(fd, size) < 0) {
+        // Sparse file: holes read as zeros until chunks are written
+        std::cerr << "Không thể tạo file: " << strerror(errno) << std::endl;
     }
 
-    out.close();
+    close(fd);
     std::cout << "File đã được tạo với kích thước: " << size << " bytes." << std::endl;
 }
 
-void overwriteAtChunk(std::string filename, uint64_t chunk_id, uint64_t chunk_size, char* data, size_t data_len) {
-    filename = DOWNLOADS_DIR + filename;
-    // Mở file ở chế độ ghi nhị phân và cho phép ghi đè
-    std::lock_guard<std::mutex> lock(packets_mtx); 
-    std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+void chunk_writer_thread(ChunkWriter& writer) {
+    std::vector<ReceivedChunk> batch;
+    std::vector<struct iovec> iovecs;
+    batch.reserve(writer.queue.capacity());     // Swapped with the queue: neither grows while chunks are pushed
+
+    while (true) {
+        {
+            // Wakes up at least every JOURNAL_FLUSH_MS to record written chunks in the journal
+            std::unique_lock<std::mutex> lock(writer.mtx);
+            writer.not_empty.wait_for(lock, std::chrono::milliseconds(JOURNAL_FLUSH_MS),
+                                      [&]{ return !writer.queue.empty() || writer.closing; });
+            if (writer.queue.empty() && writer.closing) {
+                return;     // Closing and everything is written
+            }
+            batch.swap(writer.queue);
+            writer.queued_bytes = 0;
+        }
+
+        // Chunks of the same region arrive out of order from 4 threads: sort them to find runs
+        std::sort(batch.begin(), batch.end());
+
+        size_t i = 0;
+        while (i < batch.size()) {
+            uint64_t offset = batch[i].id * writer.chunk_size;
+            size_t run_len = 0;
+            iovecs.clear();
+
+            // Adjacent chunks (only the last chunk of a file is shorter than chunk_size)
+            size_t j = i;
+            while (j < batch.size() && iovecs.size() < MAX_WRITE_IOVECS
+                   && batch[j].id * writer.chunk_size == offset + run_len) {
+                iovecs.push_back({batch[j].data.data(), batch[j].data.size()});
+                run_len += batch[j].data.size();
+                j++;
+            }
+
+            // pwritev may write less than asked
+            size_t iov_index = 0;
+            while (iov_index < iovecs.size()) {
+                ssize_t written = pwritev(writer.fd, iovecs.data() + iov_index, iovecs.size() - iov_index, offset);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    perror("Không thể ghi file");
+                    break;
+                }
+                offset += written;
+                while (iov_index < iovecs.size() && (size_t)written >= iovecs[iov_index].iov_len) {
+                    written -= iovecs[iov_index].iov_len;
+                    iov_index++;
+                }
+                if (iov_index < iovecs.size()) {
+                    iovecs[iov_index].iov_base = (char*)iovecs[iov_index].iov_base + written;
+                    iovecs[iov_index].iov_len -= written;
+                }
+            }
 
-    if (!file) {
+            // Chunks of a failed write stay missing in the journal and go back to the download loop
+            if (iov_index == iovecs.size()) {
+                for (size_t k = i; k < j; k++) {
+                    journal_mark(writer.journal, batch[k].id);
+                }
+            } else {
+                std::lock_guard<std::mutex> lock(writer.mtx);
+                for (size_t k = i; k < j; k++) {
+                    writer.failed.push_back(batch[k].id);
+                }
+                writer.write_failures++;
+            }
+            i = j;
+        }
+
+        // Buffers go back to the pool: once warm, pushing a chunk does not allocate
+        {
+            std::lock_guard<std::mutex> lock(writer.mtx);
+            for (ReceivedChunk& chunk : batch) {
+                writer.free_buffers.push_back(std::move(chunk.data));
+            }
+        }
+        batch.clear();
+
+        if (std::chrono::steady_clock::now() - writer.journal.last_flush >= std::chrono::milliseconds(JOURNAL_FLUSH_MS)) {
+            journal_flush(writer.journal, writer.fd);
+        }
+    }
+}
+
+/// @brief Open the downloaded file and start its writer thread (threaded), or write chunks as they are pushed
+bool chunk_writer_open(ChunkWriter& writer, std::string filename, uint64_t chunk_size, bool threaded) {
+    filename = DOWNLOADS_DIR + filename;
+    writer.fd = open(filename.c_str(), O_WRONLY);
+    if (writer.fd < 0) {
         std::cerr << "Không thể mở file để ghi!" << std::endl;
+        return false;
+    }
+    writer.chunk_size = chunk_size;
+    writer.closing = false;
+    writer.threaded = threaded;
+    if (threaded) {
+        writer.queue.reserve(WRITE_QUEUE_BYTES / chunk_size + 1);     // Most chunks the queue can hold
+        writer.thread = std::thread(chunk_writer_thread, std::ref(writer));
+    }
+    return true;
+}
+
+/// @brief Queue a received chunk for writing. Never waits: a download whose queue is full stops requesting
+/// (chunk_writer_full), so only the chunks already in flight go past WRITE_QUEUE_BYTES
+void chunk_writer_push(ChunkWriter& writer, uint64_t chunk_id, const char* data, size_t data_len) {
+    if (!writer.threaded) {
+        // Small files: a few chunks, not worth starting and joining a thread
+        uint64_t offset = chunk_id * writer.chunk_size;
+        size_t done = 0;
+        while (done < data_len) {
+            ssize_t written = pwrite(writer.fd, data + done, data_len - done, offset + done);
+            if (written < 0 && errno == EINTR) continue;
+            if (written < 0) {
+                perror("Không thể ghi file");
+                std::lock_guard<std::mutex> lock(writer.mtx);
+                writer.failed.push_back(chunk_id);
+                writer.write_failures++;
+                return;
+            }
+            done += written;
+        }
+        journal_mark(writer.journal, chunk_id);
         return;
     }
 
-    uint64_t offset = chunk_id * chunk_size;
+    // The copy is made outside the lock, into a buffer of the pool
+    ReceivedChunk chunk{chunk_id, {}};
+    {
+        std::lock_guard<std::mutex> lock(writer.mtx);
+        if (!writer.free_buffers.empty()) {
+            chunk.data = std::move(writer.free_buffers.back());
+            writer.free_buffers.pop_back();
+        }
+    }
+    chunk.data.assign(data, data + data_len);
+    {
+        std::lock_guard<std::mutex> lock(writer.mtx);
+        writer.queued_bytes += data_len;
+        writer.queue.push_back(std::move(chunk));
+    }
+    writer.not_empty.notify_one();
+}
 
-    // Di chuyển con trỏ đến vị trí offset
-    file.seekp(offset, std::ios::beg);
+/// @brief True if WRITE_QUEUE_BYTES are waiting for the writer: the disk is behind, request nothing more for now
+bool chunk_writer_full(ChunkWriter& writer) {
+    std::lock_guard<std::mutex> lock(writer.mtx);
+    return writer.queued_bytes >= WRITE_QUEUE_BYTES;
+}
 
-    // Ghi dữ liệu tại offset
-    file.write(data, data_len);
+/// @brief Write everything still queued, stop the writer thread and close the file and its journal
+void chunk_writer_close(ChunkWriter& writer) {
+    if (writer.fd < 0) {
+        return;
+    }
+    if (writer.threaded) {
+        {
+            std::lock_guard<std::mutex> lock(writer.mtx);
+            writer.closing = true;
+        }
+        writer.not_empty.notify_one();
+        writer.thread.join();
+    }
+    journal_close(writer.journal, writer.fd);
+    close(writer.fd);
+    writer.fd = -1;
+}
 
-    file.close();
+/// @brief Request chunks of to_request from the flow's server, as many as its share of that server's congestion window
+/// allows (active_flows sockets on it, at most limit), bitmap windows of MAX_BATCH_CHUNKS. Return the number requested
+uint64_t request_chunks(DownloadFlow& flow, int active_flows, uint32_t pacing_rate, uint16_t fec_group, uint64_t limit) {
+    CongestionController& cc = *flow.cc;
+    std::set<uint64_t>& to_request = flow.to_request;
+    std::map<uint64_t, RequestedChunk>& requested = flow.requested;
+    auto& request_order = flow.request_order;
+    char request[sizeof(PacketHeader) + sizeof(uint32_t) + MAX_BATCH_CHUNKS / 8];
+    char payload[sizeof(uint32_t) + MAX_BATCH_CHUNKS / 8];
+    char* bitmap = payload + sizeof(uint32_t);
+    uint64_t share = std::max<uint64_t>(1, (uint64_t)cc.window() / std::max(1, active_flows));
+    uint64_t window = std::min({cc.available(), share > flow.in_flight ? share - flow.in_flight : 0, limit});
+    uint64_t requested_count = 0;
+    auto now = std::chrono::steady_clock::now();
+    auto it = to_request.begin();
+
+    pacing_rate = htonl(pacing_rate);
+    memcpy(payload, &pacing_rate, sizeof(pacing_rate));
+
+    while (it != to_request.end() && window > 0) {
+        uint64_t first = *it;
+        uint64_t count = 0;
+        memset(bitmap, 0, MAX_BATCH_CHUNKS / 8);
+
+        while (it != to_request.end() && *it - first < MAX_BATCH_CHUNKS && window > 0) {
+            bitmap[(*it - first) / 8] |= 1 << ((*it - first) % 8);
+
+            // A chunk requested again gives no RTT sample
+            auto [req_it, inserted] = requested.try_emplace(*it, RequestedChunk{now, false, false});
+            if (!inserted) {
+                req_it->second = RequestedChunk{now, true, false};
+            }
+            request_order.emplace_back(*it, now);
+            window--;
+            count++;
+            it = to_request.erase(it);
+        }
+
+        uint64_t last = request_order.back().first;
+        size_t request_len = build_packet(request, OP_REQUEST_CHUNKS, flow.file_handle, first, 0,
+                                          payload, sizeof(uint32_t) + (last - first) / 8 + 1, fec_group);
+        sendto(flow.sock, request, request_len, 0,
+                        (const sockaddr*)&mirrors[flow.mirror], sizeof(sockaddr_in));
+        cc.on_send(count);
+        flow.in_flight += count;
+        requested_count += count;
+    }
+    return requested_count;
 }
 
-void thread_chunk(int thread_part, int client_sock, std::string filename, uint64_t start_chunk, uint64_t end_chunk, struct ThreadTracker& tracker, struct Metadata& metadata) {
-    char buffer[BUFFER_SIZE];
-    fd_set readfds;
-    struct timeval timeout;
+/// @brief Give half of the largest backlog (highest chunks) to a socket that has nothing left to request
+bool scheduler_steal(std::vector<DownloadFlow>& flows, DownloadFlow& thief) {
+    DownloadFlow* victim = nullptr;
+    for (DownloadFlow& flow : flows) {
+        if (&flow != &thief && (victim == nullptr || flow.to_request.size() > victim->to_request.size())) {
+            victim = &flow;
+        }
+    }
+    if (victim == nullptr || victim->to_request.empty()) {
+        return false;
+    }
 
-    for (uint64_t chunk_id = start_chunk; chunk_id < end_chunk; chunk_id++) {
-        tracker.downloading_chunk.insert(chunk_id);
+    // Victim keeps its lowest chunks (requested next), thief takes the other end
+    size_t steal = (victim->to_request.size() + 1) / 2;
+    auto it = std::prev(victim->to_request.end());
+    while (steal--) {
+        thief.to_request.insert(*it);
+        if (it == victim->to_request.begin()) {
+            victim->to_request.erase(it);
+            break;
+        }
+        it = std::prev(victim->to_request.erase(it));
     }
+    return true;
+}
 
-    while (true) {
-        FD_ZERO(&readfds);
-        FD_SET(client_sock, &readfds);
+/// @brief End game: request chunks in flight on other sockets again on this one (each at most ENDGAME_COPIES times)
+void scheduler_endgame(std::vector<DownloadFlow>& flows, DownloadFlow& idle) {
+    for (DownloadFlow& flow : flows) {
+        if (&flow == &idle) {
+            continue;
+        }
+        for (auto& [chunk_id, request] : flow.requested) {
+            if (request.lost || idle.requested.count(chunk_id)) {
+                continue;
+            }
+            int copies = 0;
+            for (DownloadFlow& other : flows) {
+                auto it = other.requested.find(chunk_id);
+                copies += it != other.requested.end() && !it->second.lost;
+            }
+            if (copies < ENDGAME_COPIES) {
+                idle.to_request.insert(chunk_id);
+            }
+        }
+    }
+}
 
-        // Thiết lập timeout (ví dụ: 1000ms)
-        timeout.tv_sec = SENDING_TIMEOUT / 1000;
-        timeout.tv_usec = (SENDING_TIMEOUT % 1000) * 1000;
+/// @brief A chunk has been received: no socket requests or waits for it any more
+void scheduler_complete(std::vector<DownloadFlow>& flows, uint64_t chunk_id) {
+    for (DownloadFlow& flow : flows) {
+        flow.to_request.erase(chunk_id);
+        auto it = flow.requested.find(chunk_id);
+        if (it == flow.requested.end()) {
+            continue;
+        }
+        if (!it->second.lost) {
+            flow.in_flight--;
+            flow.cc->on_cancel();
+        }
+        flow.requested.erase(it);
+    }
+}
+
+/// @brief Record a received OP_PARITY: its group is rebuilt as the members arrive
+void fec_parity(DownloadFlow& flow, const PacketHeader& header, const char* data) {
+    FecGroup& group = flow.fec_groups[header.seq % FEC_GROUPS];
+    if (group.data.size() < header.length) {
+        group.data.resize(header.length);       // Once per slot
+    }
+    memcpy(group.data.data(), data, header.length);
+    group.data_len = header.length;
+    group.parity_seq = header.seq;
+    group.first_chunk = header.chunk_id;
+    group.members = header.flags;
+    group.received = 0;
+}
 
-        // Chờ sự kiện hoặc timeout
-        int activity = select(client_sock + 1, &readfds, nullptr, nullptr, &timeout);
+/// @brief XOR a received chunk (uncompressed) into the parity of its FEC group. Return the group once every member
+/// but one is in (its data is then the missing chunk, see fec_missing), nullptr otherwise
+FecGroup* fec_member(DownloadFlow& flow, const PacketHeader& header, const char* data, size_t data_len) {
+    uint16_t place = header.flags & ~CHUNK_COMPRESSED;
+    if (place == 0 || place > FEC_MAX_GROUP || header.seq < place) {
+        return nullptr;     // Not sent as part of a group
+    }
+
+    // A member is here: the parity is of no use any more, even if it was lost (no resend of it)
+    uint64_t parity_seq = header.seq - place;
+    ack_mark(flow.acks, parity_seq);
+
+    FecGroup& group = flow.fec_groups[parity_seq % FEC_GROUPS];
+    uint16_t bit = 1 << (place - 1);
+    if (group.parity_seq != parity_seq || (group.received & bit) || data_len > group.data_len) {
+        return nullptr;
+    }
+    fec_xor(group.data.data(), data, data_len);
+    group.received |= bit;
+
+    int missing = __builtin_popcount(group.members) - __builtin_popcount(group.received);
+    if (missing == 0) {
+        group.parity_seq = UINT64_MAX;      // Nothing lost
+    }
+    return missing == 1 ? &group : nullptr;
+}
 
-        if (activity < 0) {
-            perror("select error");
+/// @brief Chunk id and seq of the member an FEC group is missing
+void fec_missing(const FecGroup& group, uint64_t& chunk_id, uint64_t& seq) {
+    int place = __builtin_ctz(~(uint32_t)group.received);      // 0-based
+    seq = group.parity_seq + 1 + place;
+    chunk_id = group.first_chunk;
+    for (int i = 0, member = 0; i < FEC_MAX_GROUP; i++) {
+        if ((group.members & (1 << i)) && member++ == place) {
+            chunk_id = group.first_chunk + i;
             break;
         }
+    }
+}
+
+/// @brief Read every datagram waiting on the socket of a flow (up to MAX_READS_PER_EVENT), ACK them and queue chunks
+void flow_receive(Download& download, DownloadFlow& flow, std::vector<char>& buffer) {
+    ChunkScheduler& scheduler = download.scheduler;
+    CongestionController& cc = *flow.cc;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    // A chunk is here, received or rebuilt from its FEC group: no socket waits for it any more
+    auto deliver = [&](uint64_t chunk_id, const char* data, size_t data_len, bool rebuilt) {
+        // Duplicates (end game, re-requests) are dropped here
+        if (chunk_id >= scheduler.total_chunk || scheduler.received[chunk_id]) {
+            return;
+        }
+
+        // Wrong data (CRC32 collision, bad server): dropped, the chunk times out and is requested again
+        if (merkle_leaf(data, data_len) != download.chunk_hashes[chunk_id]) {
+            scheduler.corrupted_chunk++;
+            return;
+        }
+
+        // Feed the congestion controller (late chunks already counted as lost are not, rebuilt ones give no RTT)
+        auto req_it = flow.requested.find(chunk_id);
+        if (req_it != flow.requested.end() && req_it->second.lost) {
+            flow.requested.erase(req_it);
+        } else if (req_it != flow.requested.end()) {
+            auto now = std::chrono::steady_clock::now();
+            double rtt_ms = std::chrono::duration<double, std::milli>(now - req_it->second.sent_time).count();
+            cc.on_ack(req_it->second.retransmitted || rebuilt ? -1 : rtt_ms, now);
+            flow.requested.erase(req_it);
+            flow.in_flight--;
+        }
+        scheduler.received[chunk_id] = true;
+        scheduler.missing_chunk--;
+        scheduler_complete(download.flows, chunk_id);
+        flow.received_chunk++;
+        scheduler.recovered_chunk += rebuilt;
+
+        // Ghi dữ liệu vào file
+        chunk_writer_push(download.writer, chunk_id, data, data_len);
+    };
+
+    // The chunk an FEC group misses is its parity XOR the other members, acknowledged as if received
+    // so the server does not resend it
+    auto rebuild = [&](FecGroup& group) {
+        uint64_t chunk_id, seq;
+        fec_missing(group, chunk_id, seq);
+        ack_mark(flow.acks, seq);
+        uint64_t chunk_size = download.metadata.chunk_size;
+        if (chunk_id < scheduler.total_chunk) {
+            size_t data_len = std::min(chunk_size, download.metadata.file_size - chunk_id * chunk_size);
+            deliver(chunk_id, group.data.data(), std::min(data_len, group.data_len), true);
+        }
+        group.parity_seq = UINT64_MAX;
+    };
 
-        // Xử lý nhận dữ liệu nếu có
-        if (FD_ISSET(client_sock, &readfds)) {
-            struct sockaddr_in clientAddr;
-            socklen_t addrLen = sizeof(clientAddr);
-            size_t recv_len = recvfrom(client_sock, buffer, sizeof(buffer), 0,
-                                            (struct sockaddr*)&clientAddr, &addrLen);
+    for (int reads = 0; reads < MAX_READS_PER_EVENT; reads++) {
+        struct sockaddr_in clientAddr;
+        struct iovec iov = { buffer.data(), buffer.size() };
+        struct msghdr msg = {};
+        msg.msg_name = &clientAddr;
+        msg.msg_namelen = sizeof(clientAddr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t recv_len = recvmsg(flow.sock, &msg, 0);
+        if (recv_len < 0) {
+            return;     // EAGAIN: socket drained, the rest is acknowledged by the delayed ACK timer
+        }
+#ifdef COUNT_ALLOCATIONS
+        uint64_t allocations_before = thread_allocations;
+#endif
+
+        // With UDP GRO one read may hold several datagrams of segment_size bytes (last one shorter)
+        ssize_t segment_size = recv_len;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                segment_size = gso_size;
+            }
+        }
+
+        for (ssize_t offset = 0; recv_len > 0 && offset < recv_len; offset += segment_size) {
+            char* datagram = buffer.data() + offset;
+            size_t datagram_len = std::min(segment_size, recv_len - offset);
 
-            if (recv_len > BUFFER_SIZE) {
-                std::cout << "Lỗi tràn bộ nhớ!!!";
-                exit(0);
+            PacketHeader header;
+            if (!parse_packet(datagram, datagram_len, header)) {   // Gói tin lỗi thì bỏ qua
+                continue;
             }
+            if (header.seq == NO_SEQ) {
+                continue;       // OP_ERROR: sent once, not part of the reply seqs
+            }
+            ack_record(flow.acks, header.seq, std::chrono::steady_clock::now());
 
-            if (recv_len > 0) {
-                decode_and_popback(buffer, recv_len);
-                std::string message(buffer, recv_len); // Chuyển buffer sang string
-                std::vector<std::string> parts;
-                size_t pos = 0;
-                int erasedCount;
-                uint64_t seq_num;
+            // Loss rate on the way for FEC: server resends hide most losses from the chunk timeouts
+            if (header.seq >= flow.next_seq) {
+                flow.loss_skipped += header.seq - flow.next_seq;
+                flow.next_seq = header.seq + 1;
+            }
+            if (++flow.loss_received > FEC_LOSS_WINDOW) {
+                flow.loss_received /= 2;
+                flow.loss_skipped /= 2;
+            }
 
-                // Tách các phần của message
-                for (int i = 0; i < 5; ++i) { // REPLY, seq, CHUNK, filename, chunk_id
-                    size_t colon_pos = message.find(':', pos);
-                    if (colon_pos == std::string::npos) {
-                        std::cerr << "Invalid message format: missing fields!" << std::endl;
-                        break;
-                    }
-                    parts.push_back(message.substr(pos, colon_pos - pos));
-                    pos = colon_pos + 1;
+            // The member an FEC group waits for has been passed: lost (or late), rebuild it now
+            if (flow.fec_waiting >= 0) {
+                FecGroup& waiting = flow.fec_groups[flow.fec_waiting];
+                uint64_t chunk_id, seq = UINT64_MAX;
+                if (waiting.parity_seq == flow.fec_waiting_parity) {
+                    fec_missing(waiting, chunk_id, seq);
                 }
-
-                if (parts.size() != 5){    // Gói tin lỗi
-                    continue;
+                if (seq == UINT64_MAX) {
+                    flow.fec_waiting = -1;      // Completed (or its slot reused)
+                } else if (header.seq > seq) {
+                    rebuild(waiting);
+                    flow.fec_waiting = -1;
                 }
+            }
 
-                // Lấy phần dữ liệu sau chunk_id
-                std::string data_part = message.substr(pos);
-                size_t data_len = data_part.size();
-
-                // Kiểm tra chunk_id hợp lệ
-                uint64_t chunk_id;
-                try {
-                    seq_num = std::stoull(parts[1]);
-                    chunk_id = std::stoull(parts[4]);
-                    send_ack(client_sock, seq_num);
-                } catch (const std::exception& e) { // Gói tin lỗi
-                    std::cout << e.what() << "\n";
+            if (header.file_handle != flow.file_handle || header.length == 0
+                || header.length > download.metadata.chunk_size) {
+                continue;
+            }
+            char* data = datagram + sizeof(PacketHeader);
+            size_t data_len = header.length;
+
+            if (header.opcode == OP_PARITY) {
+                fec_parity(flow, header, data);
+                continue;
+            }
+            if (header.opcode != OP_CHUNK) {
+                continue;
+            }
+
+            // Compressed chunk: must give back exactly its size, else it is as bad as a wrong hash
+            if (header.flags & CHUNK_COMPRESSED) {
+                uint64_t chunk_size = download.metadata.chunk_size;
+                uint64_t expected = header.chunk_id < scheduler.total_chunk
+                                    ? std::min(chunk_size, download.metadata.file_size - header.chunk_id * chunk_size) : 0;
+                data_len = lz4_decompress(data, header.length, download.inflated.data(), download.inflated.size());
+                if (data_len != expected) {
+                    scheduler.corrupted_chunk++;
                     continue;
                 }
-                
-                erasedCount = tracker.downloading_chunk.erase(chunk_id);
-                
-                // Ghi dữ liệu vào file
-                if (data_len > 0 && erasedCount > 0 && parts[0] == REPLY && parts[2] == "CHUNK" && parts[3] == filename) {
-                    overwriteAtChunk(filename, chunk_id, metadata.chunk_size, data_part.data(), data_len);
-                    //std::cout << "[RECEIVED]: REPLY:" << parts[1] << ":CHUNK:" << filename << ":" << chunk_id << ":\n";
+                data = download.inflated.data();
+                scheduler.compressed_chunk++;
+                scheduler.compress_saved += data_len - header.length;
+            }
+
+            FecGroup* group = fec_member(flow, header, data, data_len);
+            deliver(header.chunk_id, data, data_len, false);
+            //std::cout << "[RECEIVED]: CHUNK:" << filename << ":" << header.chunk_id << "\n";
+
+            // Every member of its group but one is here: rebuilt at once if a later reply passed it already,
+            // else when the next one does
+            if (group != nullptr) {
+                uint64_t chunk_id, seq;
+                fec_missing(*group, chunk_id, seq);
+                if (seq < header.seq) {
+                    rebuild(*group);
+                } else {
+                    flow.fec_waiting = group - flow.fec_groups.data();
+                    flow.fec_waiting_parity = group->parity_seq;
                 }
             }
         }
-        
-        // Tải hết rồi thì thoát
-        if (tracker.downloading_chunk.empty()) {
-            break;
+
+        // Delayed ACK: one OP_ACK covers ACK_EVERY datagrams
+        if (flow.acks.unacked >= ACK_EVERY) {
+            ack_send(flow.sock, mirrors[flow.mirror], flow.acks, std::chrono::steady_clock::now());
         }
+#ifdef COUNT_ALLOCATIONS
+        receive_allocations += thread_allocations - allocations_before;
+        received_datagrams += recv_len / std::max<ssize_t>(1, segment_size) + (recv_len % std::max<ssize_t>(1, segment_size) != 0);
+#endif
+    }
+}
 
-        // Xử lý gửi request nếu đang trống
-        if (activity == 0) {
-            std::string header = REQUEST_CHUNK + (std::string)":" + filename + (std::string)":";   // Request chunk header
-            int token_num = TOKEN_LIMIT;
+/// @brief Chunks still missing after the RTO are lost: shrink the window of the flow's server and put them back to request
+void flow_check_losses(DownloadFlow& flow, std::chrono::steady_clock::time_point now) {
+    CongestionController& cc = *flow.cc;
+    auto rto = cc.rto();
+    while (!flow.request_order.empty() && now - flow.request_order.front().second > rto) {
+        auto [chunk_id, sent_time] = flow.request_order.front();
+        flow.request_order.pop_front();
+
+        auto req_it = flow.requested.find(chunk_id);
+        if (req_it == flow.requested.end() || req_it->second.sent_time != sent_time) {
+            continue;   // Received, or requested again later
+        }
+        req_it->second.lost = true;
+        flow.in_flight--;
+        cc.on_loss(sent_time, now);
+        flow.to_request.insert(chunk_id);
+    }
+}
 
-            for (uint64_t number: tracker.downloading_chunk) {
-                if (token_num > 0)
-                    token_num--;
-                else
-                    break;
-                
-                std::string message = header + uint64_to_string_converter(number);
-                sendto(client_sock, message.c_str(), message.size(), 0,
-                                (const sockaddr*)&server_addr, server_addr_len);
+/// @brief "ip:port" of a server
+std::string server_name(const sockaddr_in& server) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &server.sin_addr, ip, sizeof(ip));
+    return std::string(ip) + ":" + std::to_string(ntohs(server.sin_port));
+}
+
+/// @brief Print progress of a download and what each socket (and each mirror) did
+void print_progress(Download& download) {
+    ChunkScheduler& scheduler = download.scheduler;
+    std::vector<DownloadFlow>& flows = download.flows;
+    std::lock_guard<std::mutex> lock(console_mtx);
+    empty_lines(5);
+    std::cout << "Downloading " << download.filename << " .... " <<
+                100 - (scheduler.missing_chunk * 100 / std::max(1UL, scheduler.total_chunk)) << "%\n";
+    for (size_t sock_id = 0; sock_id < flows.size(); sock_id++) {
+        std::cout << "  socket " << sock_id + 1;
+        if (mirrors.size() > 1) {
+            std::cout << " (" << server_name(mirrors[flows[sock_id].mirror]) << ")";
+        }
+        std::cout << ": " << flows[sock_id].received_chunk << " chunks, " << flows[sock_id].in_flight << " in flight\n";
+    }
+    for (size_t mirror = 0; mirror < download.ccs.size(); mirror++) {
+        CongestionController* cc = download.ccs[mirror].get();
+        if (cc == nullptr) {
+            continue;
+        }
+        std::cout << "Congestion control";
+        if (mirrors.size() > 1) {
+            std::cout << " (" << server_name(mirrors[mirror]) << ")";
+        }
+        std::cout << ": " << cc->name() << ", window " << (uint64_t)cc->window() << " chunks\n";
+    }
+    if (scheduler.corrupted_chunk > 0) {
+        std::cout << "Chunk sai mã băm (tải lại): " << scheduler.corrupted_chunk << "\n";
+    }
+    if (scheduler.recovered_chunk > 0) {
+        std::cout << "Chunk khôi phục bằng FEC: " << scheduler.recovered_chunk << "\n";
+    }
+    if (scheduler.compressed_chunk > 0) {
+        std::cout << "Chunk nén: " << scheduler.compressed_chunk << " (tiết kiệm "
+                  << scheduler.compress_saved / 1024 << " KB)\n";
+    }
+#ifdef COUNT_ALLOCATIONS
+    // Non-zero only while buffers are first allocated (start of a download)
+    std::cout << "Receive path: " << receive_allocations.exchange(0) << " allocations for "
+              << received_datagrams.exchange(0) << " datagrams\n";
+#endif
+}
+
+/// @brief Arm a one-shot timerfd to fire after delay (0 = disarm)
+void arm_timer(int timer_fd, std::chrono::nanoseconds delay) {
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = delay.count() / 1000000000;
+    spec.it_value.tv_nsec = delay.count() % 1000000000;
+    timerfd_settime(timer_fd, 0, &spec, nullptr);
+}
+
+/// @brief Chunks of chunk_size bytes that may be requested now under BANDWIDTH_LIMIT, at most wanted
+uint64_t budget_take(uint64_t wanted, uint64_t chunk_size) {
+    if (BANDWIDTH_LIMIT == 0) {
+        return wanted;
+    }
+    std::lock_guard<std::mutex> lock(bandwidth_budget.mtx);
+    auto now = std::chrono::steady_clock::now();
+    double rate = BANDWIDTH_LIMIT * 1024.0;     // Bytes per second
+    double capacity = std::max<double>(rate * BANDWIDTH_BURST_MS / 1000, chunk_size);
+    double elapsed = std::chrono::duration<double>(now - bandwidth_budget.last_refill).count();
+    bandwidth_budget.tokens = std::min(capacity, bandwidth_budget.tokens + rate * elapsed);
+    bandwidth_budget.last_refill = now;
+
+    uint64_t granted = std::min<uint64_t>(wanted, (uint64_t)(bandwidth_budget.tokens / chunk_size));
+    bandwidth_budget.tokens -= (double)granted * chunk_size;
+    return granted;
+}
+
+/// @brief Give back chunks taken from the budget and not requested
+void budget_refund(uint64_t chunks, uint64_t chunk_size) {
+    if (BANDWIDTH_LIMIT == 0 || chunks == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(bandwidth_budget.mtx);
+    bandwidth_budget.tokens += (double)chunks * chunk_size;
+}
+
+/// @brief Rate a mirror should pace each socket of a download at: the congestion controller of its path, capped
+/// by the socket's share of BANDWIDTH_LIMIT
+uint32_t download_pacing_rate(Download& download, size_t mirror) {
+    int flows = (int)download.flows.size();
+    uint32_t rate = download.ccs[mirror]->pacing_rate(download.metadata.chunk_size, download.mirror_flows[mirror]);
+    if (BANDWIDTH_LIMIT == 0) {
+        return rate;
+    }
+    uint32_t share = std::max<uint32_t>(1, BANDWIDTH_LIMIT / std::max(1, active_downloads.load()) / flows);
+    return rate > 0 ? std::min(rate, share) : share;
+}
+
+/// @brief FEC group size to ask for: fixed (FEC_GROUP_SIZE), or none until chunks get lost, then fewer
+/// chunks per parity the more are lost
+uint16_t download_fec_group(Download& download) {
+    if (FEC_GROUP_SIZE != 0) {
+        return std::max(0, std::min(FEC_GROUP_SIZE, FEC_MAX_GROUP));
+    }
+    double received = 0, skipped = 0;
+    for (DownloadFlow& flow : download.flows) {
+        received += flow.loss_received;
+        skipped += flow.loss_skipped;
+    }
+    double loss_rate = skipped / std::max(1.0, received + skipped);
+    if (loss_rate < FEC_MIN_LOSS) {
+        return 0;
+    }
+    return (uint16_t)std::max(2.0, std::min<double>(FEC_MAX_GROUP, FEC_LOSS_TARGET / loss_rate));
+}
+
+/// @brief Open the file, journal and sockets of a download and add the sockets to the event loop
+/// (epoll id = download index << 32 | socket index). Sockets go round the mirrors that serve the same version,
+/// one congestion controller per mirror
+bool download_start(Download& download, uint64_t index, int epoll_fd) {
+    Metadata& metadata = download.metadata;
+    download.small = metadata.num_chunks <= SMALL_FILE_CHUNKS;
+    std::vector<size_t> sources;
+    for (size_t mirror = 0; mirror < download.mirror_handles.size() && mirror < mirrors.size(); mirror++) {
+        if (download.mirror_handles[mirror] != 0) {
+            sources.push_back(mirror);
+        }
+    }
+    if (sources.empty()) {
+        download.mirror_handles.assign(1, download.file_handle);
+        sources.push_back(0);
+    }
+
+    // Chunks are written by one writer thread through one fd, and recorded in the journal
+    ChunkWriter& writer = download.writer;
+    bool resumed = journal_open(writer.journal, download.filename, metadata);
+    if (!resumed) {
+        createFileWithSize(download.filename, metadata.file_size);   // Fulfill file with dummy bytes
+    }
+    if (!chunk_writer_open(writer, download.filename, metadata.chunk_size, !download.small)) {
+        journal_close(writer.journal, -1);
+        return false;
+    }
+    download.inflated.resize(metadata.chunk_size + 2 * sizeof(uint64_t));
+
+    // Contiguous starting ranges, rebalanced by stealing. Chunks written before an interruption are done
+    ChunkScheduler& scheduler = download.scheduler;
+    scheduler.total_chunk = metadata.num_chunks;
+    if (resumed) {
+        uint64_t corrupted = journal_verify(writer.journal, download.filename, metadata, download.chunk_hashes);
+        if (corrupted > 0) {
+            std::cout << download.filename << ": " << corrupted << " chunk đã tải bị hỏng, tải lại\n";
+        }
+    }
+    scheduler.missing_chunk = metadata.num_chunks - writer.journal.written_chunk;
+    scheduler.received.assign(metadata.num_chunks, false);
+    for (uint64_t chunk_id = 0; resumed && chunk_id < metadata.num_chunks; chunk_id++) {
+        scheduler.received[chunk_id] = journal_has(writer.journal, chunk_id);
+    }
+    if (resumed) {
+        std::cout << "Tiếp tục tải " << download.filename << ": đã có " << writer.journal.written_chunk
+                  << "/" << metadata.num_chunks << " chunk\n";
+    }
+
+    // A small file is one round trip: more sockets would only cost setup (the files of a group take turns
+    // on the mirrors). A large one has at least one socket per mirror
+    uint64_t num_sockets = download.small ? 1 : std::max<uint64_t>(NUM_DOWNLOAD_SOCKETS, sources.size());
+    download.flows = std::vector<DownloadFlow>(num_sockets);
+    download.ccs.resize(mirrors.size());
+    download.mirror_flows.assign(mirrors.size(), 0);
+    uint64_t chunks_per_socket = (metadata.num_chunks + num_sockets - 1) / num_sockets;
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    for (uint64_t sock_id = 0; sock_id < num_sockets; sock_id++) {
+        DownloadFlow& flow = download.flows[sock_id];
+        flow.mirror = sources[(download.small ? index : sock_id) % sources.size()];
+        flow.file_handle = download.mirror_handles[flow.mirror];
+        if (download.ccs[flow.mirror] == nullptr) {
+            download.ccs[flow.mirror] = make_congestion_controller(CONGESTION_CONTROL);
+        }
+        flow.cc = download.ccs[flow.mirror].get();
+        download.mirror_flows[flow.mirror]++;
+        uint64_t start_chunk = std::min(sock_id * chunks_per_socket, metadata.num_chunks);
+        uint64_t end_chunk = std::min(chunks_per_socket * (sock_id + 1), metadata.num_chunks);
+        for (uint64_t chunk_id = start_chunk; chunk_id < end_chunk; chunk_id++) {
+            if (!scheduler.received[chunk_id]) {
+                flow.to_request.insert(chunk_id);
             }
         }
+
+        flow.sock = create_socket();
+        event.data.u64 = index << 32 | sock_id;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, flow.sock, &event);
     }
 
-    close(client_sock);
+    download.running = true;
+    active_downloads++;
+    return true;
+}
+
+/// @brief Chunks the writer could not write are missing again: request them on the flow with the least to do.
+/// Return false once the download has seen more than MAX_WRITE_FAILURES failed writes
+bool download_requeue_failed(Download& download) {
+    std::vector<uint64_t> failed;
+    uint64_t write_failures;
+    {
+        std::lock_guard<std::mutex> lock(download.writer.mtx);
+        failed.swap(download.writer.failed);
+        write_failures = download.writer.write_failures;
+    }
+    ChunkScheduler& scheduler = download.scheduler;
+    for (uint64_t chunk_id : failed) {
+        if (!scheduler.received[chunk_id]) {
+            continue;
+        }
+        scheduler.received[chunk_id] = false;
+        scheduler.missing_chunk++;
+        auto least = std::min_element(download.flows.begin(), download.flows.end(),
+            [](const DownloadFlow& a, const DownloadFlow& b) { return a.to_request.size() < b.to_request.size(); });
+        least->to_request.insert(chunk_id);
+    }
+    return write_failures <= MAX_WRITE_FAILURES;
 }
 
-void download_file(std::string filename) {      // Data gets from file_downloading metadata
-    struct Metadata metadata = get_metadata(filename);
-    struct ThreadTracker download_tracker[4];
-    std::vector<std::thread> threads;
+/// @brief Acknowledge the last replies, close the sockets and write what is left (complete or interrupted).
+/// Return true if every chunk is on disk
+bool download_finish(Download& download) {
+    // Last replies must be acknowledged too, or the server keeps resending them
+    for (DownloadFlow& flow : download.flows) {
+        if (flow.acks.unacked > 0) {
+            ack_send(flow.sock, mirrors[flow.mirror], flow.acks, std::chrono::steady_clock::now());
+        }
+        close(flow.sock);       // Also leaves the epoll set
+    }
+    chunk_writer_close(download.writer);
+    if (!download.small) {
+        print_progress(download);
+    }
 
-    createFileWithSize(filename, metadata.file_size);   // Fulfill file with dummy bytes
-    auto now = std::chrono::steady_clock::now();
-    
-    uint64_t socket_quantity = NUM_DOWNLOAD_THREADS;
-    uint64_t chunks_per_thread = (metadata.num_chunks + NUM_DOWNLOAD_THREADS - 1) / NUM_DOWNLOAD_THREADS;
+    // Writes that failed while closing leave holes: the journal keeps them for the next scan
+    bool complete = download.scheduler.missing_chunk == 0 && download.writer.failed.empty();
+    if (complete) {
+        std::lock_guard<std::mutex> lock(console_mtx);
+        std::cout << "Downloading " << download.filename << " done.\n";
+    } else if (download.writer.write_failures > 0) {
+        std::lock_guard<std::mutex> lock(console_mtx);
+        std::cerr << "Không ghi được " << download.filename << ", phần còn thiếu sẽ được tải lại sau\n";
+    }
+    download.running = false;
+    active_downloads--;
+    return complete;
+}
 
-    //std::cout << metadata.num_chunks << "\n";
-    for (int sock_id = 0; sock_id < socket_quantity; sock_id++) {
-        uint64_t start_chunk = sock_id * chunks_per_thread;
-        uint64_t end_chunk = std::min(chunks_per_thread * (sock_id + 1), metadata.num_chunks);
-        download_tracker[sock_id].total_chunk = end_chunk - start_chunk;
+/// @brief Download a group of files in one event loop: every socket of every file, the loss timer and the
+/// progress timer. Return the number of files completed
+int download_files(const std::vector<std::string>& filenames) {
+    downloading++;
+    std::vector<std::unique_ptr<Download>> downloads;
+    for (const std::string& filename : filenames) {
+        downloads.push_back(std::make_unique<Download>());
+        downloads.back()->filename = filename;
+    }
 
-        int socket_fd = create_socket();
-        threads.emplace_back(thread_chunk, sock_id + 1, socket_fd, filename, start_chunk, end_chunk, std::ref(download_tracker[sock_id]), std::ref(metadata));
+    // One round trip for the metadata of the whole group
+    get_metadata(downloads);
+
+    int epoll_fd = epoll_create1(0);
+    int wake_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);     // Next RTO, delayed ACK or bandwidth budget
+    int progress_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    const uint64_t WAKE_TIMER_ID = UINT64_MAX, PROGRESS_TIMER_ID = UINT64_MAX - 1;
+
+    struct itimerspec refresh = {};
+    refresh.it_value.tv_sec = refresh.it_interval.tv_sec = REFRESH_CONSOLE / 1000;
+    refresh.it_value.tv_nsec = refresh.it_interval.tv_nsec = (REFRESH_CONSOLE % 1000) * 1000000;
+    timerfd_settime(progress_timer, 0, &refresh, nullptr);
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = WAKE_TIMER_ID;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_timer, &event);
+    event.data.u64 = PROGRESS_TIMER_ID;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, progress_timer, &event);
+
+    int running_downloads = 0;
+    for (uint64_t index = 0; index < downloads.size(); index++) {
+        if (downloads[index]->has_metadata && !interrupted && download_start(*downloads[index], index, epoll_fd)) {
+            running_downloads++;
+        }
     }
 
-    uint64_t downloading_state = 1;
-    while (downloading_state) {
+    int completed = 0;
+    std::vector<char> buffer(MAX_PACKET_SIZE);
+    struct epoll_event events[MAX_EVENTS];
+    while (running_downloads > 0 && !interrupted) {     // Ctrl+C: stop here so the journals are saved
         auto now = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_seen);
+        auto next_deadline = std::chrono::steady_clock::time_point::max();
+
+        for (std::unique_ptr<Download>& download_ptr : downloads) {
+            Download& download = *download_ptr;
+            if (!download.running) {
+                continue;
+            }
+
+            // Chunks the disk did not take are requested again, up to MAX_WRITE_FAILURES failed writes
+            if (!download_requeue_failed(download)) {
+                download_finish(download);
+                running_downloads--;
+                continue;
+            }
+
+            // Tải hết rồi thì thoát
+            if (download.scheduler.missing_chunk == 0) {
+                completed += download_finish(download);
+                running_downloads--;
+                continue;
+            }
+
+            // Losses first, so lost chunks can be stolen too
+            for (DownloadFlow& flow : download.flows) {
+                flow_check_losses(flow, now);
+            }
+
+            // The disk is behind: no new requests until the writer catches up, chunks in flight still arrive
+            bool write_full = chunk_writer_full(download.writer);
+            if (write_full) {
+                next_deadline = std::min(next_deadline, now + std::chrono::milliseconds(WRITE_QUEUE_RETRY_MS));
+            }
+
+            // Fill the windows: runs after every wakeup, so a received chunk frees room at once. Sockets of a
+            // faster mirror run out first and steal from the others: work moves to where it goes fastest
+            uint16_t fec_group = download_fec_group(download);
+            uint64_t chunk_size = std::max<uint64_t>(1, download.metadata.chunk_size);
+            for (DownloadFlow& flow : download.flows) {
+                if (!write_full) {
+                    if (flow.to_request.empty() && !scheduler_steal(download.flows, flow)
+                        && download.scheduler.missing_chunk <= ENDGAME_CHUNKS) {
+                        scheduler_endgame(download.flows, flow);
+                    }
+                    uint64_t granted = budget_take(flow.to_request.size(), chunk_size);
+                    uint64_t sent = request_chunks(flow, download.mirror_flows[flow.mirror],
+                                                   download_pacing_rate(download, flow.mirror), fec_group, granted);
+                    budget_refund(granted - sent, chunk_size);
+                    if (sent == granted && granted < flow.to_request.size() + sent) {
+                        // Held back by the bandwidth budget: retry once one more chunk is allowed
+                        next_deadline = std::min(next_deadline, now + std::chrono::microseconds(
+                            (int64_t)(chunk_size * 1000000.0 / (std::max(1, BANDWIDTH_LIMIT) * 1024.0)) + 1));
+                    }
+                }
+                if (!flow.request_order.empty()) {
+                    next_deadline = std::min(next_deadline, flow.request_order.front().second + flow.cc->rto());
+                }
 
-        if (elapsed.count() > REFRESH_CONSOLE) {
-            empty_lines(5);
-            downloading_state = 0;
-            
-            for (int sock_id = 0; sock_id < socket_quantity; sock_id++)
-            {
-                downloading_state |= download_tracker[sock_id].downloading_chunk.size();
-                std::cout << "Downloading " << filename << " part " << sock_id + 1 << " .... " << 
-                            100 - (download_tracker[sock_id].downloading_chunk.size() * 100 / std::max(1UL, download_tracker[sock_id].total_chunk)) << "%\n";
+                // Delayed ACK
+                if (flow.acks.unacked > 0) {
+                    auto ack_deadline = flow.acks.first_unacked + std::chrono::milliseconds(DELAYED_ACK_MS);
+                    if (now >= ack_deadline) {
+                        ack_send(flow.sock, mirrors[flow.mirror], flow.acks, now);
+                    } else {
+                        next_deadline = std::min(next_deadline, ack_deadline);
+                    }
+                }
+            }
+        }
+        if (running_downloads == 0) {
+            break;
+        }
+
+        // Wake up for the oldest request's RTO or a delayed ACK, no fixed polling interval
+        if (next_deadline != std::chrono::steady_clock::time_point::max()) {
+            arm_timer(wake_timer, std::max<std::chrono::nanoseconds>(next_deadline - now, std::chrono::milliseconds(1)));
+        }
+
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (num_events < 0 && errno != EINTR) {
+            perror("epoll error");
+            break;
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            uint64_t id = events[i].data.u64;
+            uint64_t expirations;
+            if (id == WAKE_TIMER_ID) {
+                read(wake_timer, &expirations, sizeof(expirations));
+            } else if (id == PROGRESS_TIMER_ID) {
+                read(progress_timer, &expirations, sizeof(expirations));
+                for (std::unique_ptr<Download>& download : downloads) {
+                    if (download->running && !download->small) {
+                        print_progress(*download);
+                    }
+                }
+            } else {
+                Download& download = *downloads[id >> 32];
+                flow_receive(download, download.flows[id & 0xFFFFFFFF], buffer);
             }
-            last_seen = now;
         }
     }
-    
-    // Đợi tất cả luồng kết thúc
-    for (auto& t : threads) {
-        t.join();
+
+    // Interrupted (or epoll failed): what is received is written and recorded in the journals
+    for (std::unique_ptr<Download>& download : downloads) {
+        if (download->running) {
+            download_finish(*download);
+        }
+    }
+    close(wake_timer);
+    close(progress_timer);
+    close(epoll_fd);
+    downloading--;
+    return completed;
+}
+
+/// @brief Ctrl+C stopped a download: its progress is saved, leave now
+void exit_if_interrupted() {
+    if (interrupted) {
+        std::cout << "\nĐã nhận tín hiệu Ctrl+C. Đã lưu tiến trình tải, chạy lại để tải tiếp.\n";
+        exit(0);
     }
-    std::cout << "Downloading " << filename <<" done.\n";
 }
 
 std::string byte_name_converter(float bytes) {
@@ -426,41 +1683,233 @@ std::string byte_name_converter(float bytes) {
     return res.str();  // Trả về chuỗi kết quả
 }
 
-void read_list() {
-    std::string filename = (std::string)DOWNLOADS_DIR + SERVER_LIST_FILE;
-    std::ifstream file(filename);  // Mở file để đọc (thay đổi tên file nếu cần)
-    if (!file.is_open()) {
-        std::cerr << "Không thể lấy danh sách từ server!" << std::endl;
+/// @brief Fetch the whole catalog of one server on one socket: page 0 tells how many pages there are, the others
+/// are asked for together (METADATA_WINDOW in flight). Handles are for chunk_size. pending tells if the server left
+/// files out until it has hashed them. Return false if the server did not answer
+bool catalog_fetch(const sockaddr_in& server, uint32_t chunk_size, std::vector<std::pair<CatalogEntry, std::string>>& entries,
+                   bool& pending_files) {
+    char buffer[MAX_PACKET_SIZE];
+    int client_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (client_sock < 0) {
+        std::cerr << "Lỗi tạo socket" << std::endl;
         exit(0);
     }
+    chunk_size = htonl(chunk_size);
+
+    for (int attempt = 0; attempt < CATALOG_RESTARTS && !interrupted; attempt++) {
+        std::map<uint64_t, PendingPacket> pending;     // Page => its request
+        std::vector<std::vector<std::pair<CatalogEntry, std::string>>> pages;
+        uint64_t generation = 0, next_page = 1, received_pages = 0;
+        bool restart = false, failed = false;
+        pending_files = false;
+
+        auto send_request = [&](uint64_t page) {
+            PendingPacket& request = pending[page];
+            request.buffer_len = build_packet(request.buffer, OP_REQUEST_CATALOG, 0, page, 0, (const char*)&chunk_size, sizeof(chunk_size),
+                                              COMPRESSION);
+            request.send_time = std::chrono::steady_clock::now();
+            request.retry_count = 0;
+            sendto(client_sock, request.buffer, request.buffer_len, 0, (const sockaddr*)&server, sizeof(server));
+        };
+        send_request(0);
+
+        AckState acks;
+        while ((!pending.empty() || next_page < pages.size()) && !restart && !failed && !interrupted) {
+            // Once the page count is known, keep METADATA_WINDOW pages in flight
+            while (!pages.empty() && next_page < pages.size() && pending.size() < METADATA_WINDOW) {
+                send_request(next_page++);
+            }
 
-    std::cout << "--------Danh sách file có thể tải:---------\n";
+            auto next_retry = std::chrono::steady_clock::time_point::max();
+            for (auto& [page, packet] : pending) {
+                next_retry = std::min(next_retry, packet.send_time + metadata_rto(packet.retry_count));
+            }
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(next_retry - std::chrono::steady_clock::now());
+            struct pollfd pfd = {client_sock, POLLIN, 0};
+            int ready = poll(&pfd, 1, std::max<int>(0, wait.count()));
+            auto now = std::chrono::steady_clock::now();
+
+            PacketHeader header;
+            ssize_t recv_len = ready > 0 ? recv(client_sock, buffer, sizeof(buffer), 0) : -1;
+            if (recv_len > 0 && parse_packet(buffer, recv_len, header)) {
+                char* payload = buffer + sizeof(PacketHeader);
+                if (header.seq != NO_SEQ) {
+                    ack_record(acks, header.seq, now);
+                    ack_send(client_sock, server, acks, now);
+                }
 
-    std::string line;
-    while (std::getline(file, line)) {
-        // Tìm vị trí của dấu cách cuối cùng
-        size_t pos = line.find_last_of(' ');
+                auto it = pending.find(header.chunk_id);
+                if (header.opcode == OP_CATALOG && header.length >= sizeof(CatalogPage) && it != pending.end()) {
+                    CatalogPage page;
+                    memcpy(&page, payload, sizeof(page));
+                    if (it->second.retry_count == 0) {
+                        metadata_rtt_sample(it->second.send_time, now);
+                    }
+                    pending.erase(it);
+
+                    // The first page answered fixes the generation, a later one from another generation restarts
+                    if (pages.empty()) {
+                        generation = ntohll(page.generation);
+                        pages.resize(std::max<uint32_t>(1, ntohl(page.page_count)));
+                    } else if (ntohll(page.generation) != generation || header.chunk_id >= pages.size()) {
+                        restart = true;
+                        continue;
+                    }
 
-        // Kiểm tra nếu có ít nhất 1 dấu cách
-        if (pos != std::string::npos) {
-            // Tách tên file (trước dấu cách cuối cùng) và kích thước (sau dấu cách cuối cùng)
-            std::string filename = line.substr(0, pos);
-            std::string size_str = line.substr(pos + 1);
+                    // Entries: CatalogEntry + name, never past the payload
+                    size_t offset = sizeof(CatalogPage);
+                    for (uint32_t i = 0; i < ntohl(page.entry_count) && offset + sizeof(CatalogEntry) <= header.length; i++) {
+                        CatalogEntry entry;
+                        memcpy(&entry, payload + offset, sizeof(entry));
+                        size_t name_len = ntohs(entry.name_len);
+                        offset += sizeof(entry);
+                        if (offset + name_len > header.length) {
+                            break;
+                        }
+                        pages[header.chunk_id].emplace_back(entry, std::string(payload + offset, name_len));
+                        offset += name_len;
+                    }
+                    pending_files |= (header.flags & CATALOG_PENDING) != 0;
+                    received_pages++;
+                } else if (header.opcode == OP_ERROR) {
+                    restart = true;     // Asked for a page past the end: the catalog shrank
+                }
+            }
 
-            // Chuyển kích thước từ chuỗi sang uint64_t
-            uint64_t size = 0;
-            std::istringstream(size_str) >> size;
-            
-            // In kết quả
-            std::cout << filename << "\t " << byte_name_converter(size) << "\n";
+            for (auto& [page, packet] : pending) {
+                if (now - packet.send_time < metadata_rto(packet.retry_count)) {
+                    continue;
+                }
+                if (packet.retry_count >= MAX_RETRIES) {
+                    failed = true;
+                    break;
+                }
+                sendto(client_sock, packet.buffer, packet.buffer_len, 0, (const sockaddr*)&server, sizeof(server));
+                packet.send_time = now;
+                packet.retry_count++;
+            }
         }
+        if (failed || interrupted) {
+            break;
+        }
+        if (restart || received_pages < pages.size()) {
+            continue;
+        }
+
+        // Complete
+        entries.clear();
+        for (auto& page : pages) {
+            entries.insert(entries.end(), std::make_move_iterator(page.begin()), std::make_move_iterator(page.end()));
+        }
+        close(client_sock);
+        return true;
     }
-    std::cout << "----------------------------------\n";
 
-    file.close();  // Đóng file
+    close(client_sock);
+    return false;
 }
 
-void download_and_checkfile() {
+/// @brief Fetch the catalog of every server at once. Refreshes metadata_cache from the main server's (entries of an
+/// unchanged version keep their verified chunk hashes) with the handle of each mirror listing the same content (size,
+/// chunk count and root hash), and returns (filename, size) in name order, false if the main server did not answer.
+/// Catalogs a server is still hashing files for are fetched again for a while, files still left out after that get
+/// their metadata from OP_REQUEST_METADATA
+bool fetch_catalog(std::vector<std::pair<std::string, uint64_t>>& files) {
+    uint32_t chunk_size = request_chunk_size();
+    std::vector<std::vector<std::pair<CatalogEntry, std::string>>> catalogs(mirrors.size());
+    std::vector<char> answered(mirrors.size());
+    std::vector<char> pending(mirrors.size(), true);
+    for (int attempt = 0; attempt <= CATALOG_PENDING_RETRIES && !interrupted; attempt++) {
+        if (attempt > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(CATALOG_PENDING_WAIT_MS));
+        }
+        std::vector<std::thread> fetches;
+        for (size_t mirror = 0; mirror < mirrors.size(); mirror++) {
+            if (!pending[mirror]) {
+                continue;
+            }
+            fetches.emplace_back([&, mirror] {
+                bool pending_files = false;
+                answered[mirror] = catalog_fetch(mirrors[mirror], chunk_size, catalogs[mirror], pending_files);
+                pending[mirror] = answered[mirror] && pending_files;
+            });
+        }
+        for (std::thread& fetch : fetches) {
+            fetch.join();
+        }
+        if (std::find(pending.begin(), pending.end(), true) == pending.end()) {
+            break;
+        }
+    }
+    if (!answered[0]) {
+        return false;
+    }
+
+    // Name => handle of every mirror that answered: used where it agrees with the main server
+    std::vector<std::unordered_map<std::string, CatalogEntry>> mirror_entries(mirrors.size());
+    for (size_t mirror = 1; mirror < mirrors.size(); mirror++) {
+        if (!answered[mirror]) {
+            std::cerr << "Mirror " << server_name(mirrors[mirror]) << " không trả lời, bỏ qua" << std::endl;
+        }
+        for (auto& [entry, filename] : catalogs[mirror]) {
+            mirror_entries[mirror][filename] = entry;
+        }
+    }
+
+    // Refresh the cache, files gone from the catalog are forgotten
+    std::lock_guard<std::mutex> lock(metadata_cache_mtx);
+    std::unordered_map<std::string, CachedMetadata> cache;
+    files.clear();
+    for (auto& [entry, filename] : catalogs[0]) {
+        CachedMetadata cached;
+        cached.file_handle = ntohl(entry.file_handle);
+        cached.metadata.file_size = ntohll(entry.file_size);
+        cached.metadata.num_chunks = ntohll(entry.num_chunks);
+        cached.metadata.chunk_size = ntohll(entry.chunk_size);
+        memcpy(cached.metadata.root_hash, entry.root_hash, SHA256_SIZE);
+        cached.version = ntohll(entry.version);
+
+        cached.mirror_handles.assign(mirrors.size(), 0);
+        cached.mirror_handles[0] = cached.file_handle;
+        for (size_t mirror = 1; mirror < mirrors.size(); mirror++) {
+            auto other = mirror_entries[mirror].find(filename);
+            if (other != mirror_entries[mirror].end() && other->second.file_size == entry.file_size
+                && other->second.num_chunks == entry.num_chunks && other->second.chunk_size == entry.chunk_size
+                && memcmp(other->second.root_hash, entry.root_hash, SHA256_SIZE) == 0) {
+                cached.mirror_handles[mirror] = ntohl(other->second.file_handle);
+            }
+        }
+
+        auto old = metadata_cache.find(filename);
+        if (old != metadata_cache.end() && old->second.version == cached.version
+            && old->second.file_handle == cached.file_handle
+            && memcmp(old->second.metadata.root_hash, cached.metadata.root_hash, SHA256_SIZE) == 0) {
+            cached.chunk_hashes = std::move(old->second.chunk_hashes);
+        }
+        files.emplace_back(filename, cached.metadata.file_size);
+        cache[filename] = std::move(cached);
+    }
+    metadata_cache = std::move(cache);
+    return true;
+}
+
+void read_list() {
+    std::vector<std::pair<std::string, uint64_t>> files;
+    if (!fetch_catalog(files)) {
+        std::cerr << "Không thể lấy danh sách từ server!" << std::endl;
+        exit(0);
+    }
+    std::cout << "--------Danh sách file có thể tải:---------\n";
+    for (auto& [filename, size] : files) {
+        std::cout << filename << "\t " << byte_name_converter(size) << "\n";
+    }
+    std::cout << "----------------------------------\n";
+}
+
+/// @brief Files of input.txt not downloaded yet (missing in downloads/, or interrupted), grouped for the
+/// download manager: small files (size from the catalog, fetched again on every scan) SMALL_FILE_BATCH at a
+/// time, other files alone
+std::deque<std::vector<std::string>> scan_downloads() {
     DIR *dir = opendir(DOWNLOADS_DIR);
     std::ifstream file(CLIENT_LIST_FILE);  // Mở file để đọc (thay đổi tên file nếu cần)
 
@@ -486,39 +1935,135 @@ void download_and_checkfile() {
     }
     closedir(dir);
 
+    // Without the catalog every file goes alone, with its own metadata request
+    std::vector<std::pair<std::string, uint64_t>> files;
+    std::unordered_map<std::string, uint64_t> sizes;
+    if (fetch_catalog(files)) {
+        for (auto& [filename, size] : files) {
+            sizes[filename] = size;
+        }
+    }
+
+    std::deque<std::vector<std::string>> groups;
+    std::vector<std::string> small_files;
+    std::set<std::string> queued;
     std::string filename;
     while (std::getline(file, filename)) {  // Quét từng file trong danh sách
-        if (f[filename] == false && filename.size()) // Chưa có file này
-        {
-            file.close();
-            download_file(filename);
-            std::cout << "\nRefreshing...\n";
-            return;
+        // Chưa có file này, or its download was interrupted (journal left)
+        if (filename.empty() || (f[filename] && !journal_exists(filename)) || !queued.insert(filename).second) {
+            continue;
+        }
+        auto size = sizes.find(filename);
+        if (size == sizes.end() || size->second > SMALL_FILE_SIZE) {
+            groups.push_back({filename});
+            continue;
         }
+        small_files.push_back(filename);
+        if (small_files.size() == SMALL_FILE_BATCH) {
+            groups.push_back(std::move(small_files));
+            small_files.clear();
+        }
+    }
+    if (!small_files.empty()) {
+        groups.push_back(std::move(small_files));
     }
 
     file.close();
+    return groups;
 }
 
-void read_console(char* server_ip) {
-    std::cout << "Nhập IP server (mặc định 127.0.0.1): ";
-    while (std::cin.getline(server_ip, 15)) {
-        if (strlen(server_ip) == 0) {
-            strcpy(server_ip, "127.0.0.1");
-            break;
+/// @brief Download everything input.txt asks for, MAX_PARALLEL_DOWNLOADS groups at a time, then scan again
+void download_manager() {
+    while (true) {
+        std::deque<std::vector<std::string>> groups = scan_downloads();
+        std::mutex groups_mtx;
+        std::atomic<int> completed{0};
+
+        std::vector<std::thread> workers;
+        size_t num_workers = std::min<size_t>(MAX_PARALLEL_DOWNLOADS, groups.size());
+        for (size_t i = 0; i < num_workers; i++) {
+            workers.emplace_back([&] {
+                while (true) {
+                    std::vector<std::string> group;
+                    {
+                        std::lock_guard<std::mutex> lock(groups_mtx);
+                        if (groups.empty() || interrupted) {
+                            return;
+                        }
+                        group = std::move(groups.front());
+                        groups.pop_front();
+                    }
+                    completed += download_files(group);
+                }
+            });
         }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        exit_if_interrupted();
 
-        if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-            std::cerr << "Địa chỉ IP không hợp lệ" << std::endl;
-            continue;
+        // Nothing new (or only failures): do not spin on input.txt and the server
+        if (completed == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(RESCAN_INTERVAL_MS));
+        } else {
+            std::cout << "\nRefreshing...\n";
         }
-        else break;
+    }
+}
 
+/// @brief Parse "ip[:port] ip[:port] ..." (SERVER_PORT when omitted) into mirrors, the first one is the main
+/// server. Return false if an address is invalid or there are more than MAX_MIRRORS
+bool parse_servers(const std::string& line, std::vector<sockaddr_in>& servers) {
+    std::istringstream words(line);
+    std::string word;
+    servers.clear();
+    while (words >> word) {
+        sockaddr_in server;
+        memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(SERVER_PORT);
+
+        size_t colon = word.find(':');
+        if (colon != std::string::npos) {
+            char* port_end;
+            unsigned long port = strtoul(word.c_str() + colon + 1, &port_end, 10);
+            if (colon + 1 == word.size() || *port_end != '\0' || port == 0 || port > 65535) {
+                return false;
+            }
+            server.sin_port = htons(port);
+            word.resize(colon);
+        }
+        if (inet_pton(AF_INET, word.c_str(), &server.sin_addr) <= 0) {
+            return false;
+        }
+        servers.push_back(server);
     }
-    empty_lines(0);
-    std::cout << "Đang lấy danh sách file từ server [" << server_ip << ":" << SERVER_PORT << "]: ...\n";
+    return servers.size() <= MAX_MIRRORS;
+}
+
+void read_console() {
+    std::cout << "Nhập IP server (mặc định 127.0.0.1; nhiều mirror: ip[:port] cách nhau bởi dấu cách): ";
+    std::string line;
+    while (getline(std::cin, line)) {
+        if (line.find_first_not_of(" \t") == std::string::npos) {
+            line = "127.0.0.1";
+        }
+        if (parse_servers(line, mirrors)) {
+            break;
+        }
+        std::cerr << "Địa chỉ IP không hợp lệ (tối đa " << MAX_MIRRORS << " server)" << std::endl;
+    }
+    if (mirrors.empty()) {
+        parse_servers("127.0.0.1", mirrors);
+    }
+    server_addr = mirrors[0];
 
-    download_file(SERVER_LIST_FILE);
+    empty_lines(0);
+    std::cout << "Đang lấy danh sách file từ server [" << server_name(server_addr) << "]";
+    if (mirrors.size() > 1) {
+        std::cout << " và " << mirrors.size() - 1 << " mirror";
+    }
+    std::cout << ": ...\n";
 
     empty_lines();
     read_list();
@@ -527,26 +2072,28 @@ void read_console(char* server_ip) {
     getline(std::cin, dummy);   // Đợi đến khi enter là nhảy
     std::cout << "\nRefreshing...\n";
 
-    while(true) {
-        download_and_checkfile();
-    }    
+    download_manager();
 }
 
+#ifndef CLIENT_NO_MAIN      // alloc_test.cpp includes this file for its functions
 int main() {
     char buffer[BUFFER_SIZE];
+    init_crc_table();
+    init_sha256();
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    
-    char server_ip[16];
     
+    // During a download the loop stops itself and saves its journal first
     auto signal_handler = [](int signum) {
+        if (downloading > 0) {
+            interrupted = true;
+            return;
+        }
         std::cout << "\nĐã nhận tín hiệu Ctrl+C. Đang kết thúc...\n";
         exit(0);
     };
     signal(SIGINT, signal_handler);
 
-    read_console(server_ip);
+    read_console();
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
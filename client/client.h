@@ -29,6 +29,12 @@
 #include <errno.h> // For errno
 #include <iostream>
 #include <stdexcept>  // Để sử dụng std::runtime_error
+#include <deque>
+#include <bitset>
+#include "congestion.h"
+#include "../common/merkle.h"
+#include "../common/fec.h"
+#include "../common/lz4.h"
 
 #ifdef _WIN32
 #include <direct.h>
@@ -36,32 +42,131 @@
 #else
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
 #endif
 
 #define CONSOLE_HEIGHT 25
 #define SERVER_PORT 12345
 #define BUFFER_SIZE 4096
-#define TOKEN_LIMIT 200 // tokens per second
-#define SENDING_TIMEOUT 200
+#define MAX_PACKET_SIZE 65536   // Receive buffer: one datagram, or one UDP_GRO super-datagram
+#define MAX_CHUNK_SIZE 65475    // Largest chunk size to ask for (server clamps to its own limit)
+#define CHUNK_SIZE_OVERRIDE 0   // Chunk size to ask for, 0 = derived from path MTU
+#define MAX_BATCH_CHUNKS 1024   // Window of one OP_REQUEST_CHUNKS bitmap (must not exceed server's)
 #define REFRESH_CONSOLE 1000
-#define SERVER_LIST_FILE "server_files.txt"
+#define SOCKET_RCVBUF_SIZE (4 << 20)    // Receive buffer of a download socket
+#define MAX_EVENTS 16           // epoll events handled per wakeup
+#define MAX_READS_PER_EVENT 64  // Datagrams read from one socket before serving the others
 #define CLIENT_LIST_FILE "input.txt"
-#define NUM_DOWNLOAD_THREADS 4
+#define NUM_DOWNLOAD_SOCKETS 4  // Sockets (server sessions) one download is split over (at least one per mirror)
+#define MAX_MIRRORS 8           // Servers given at startup: the first one lists the files, all of them serve chunks
+#define MAX_PARALLEL_DOWNLOADS 4    // Event loops (threads) downloading at once, each runs one group of files
+#define SMALL_FILE_SIZE (256 << 10) // Files up to this size (server list) are downloaded in groups
+#define SMALL_FILE_BATCH 32         // Small files per group: one metadata round trip, one event loop
+#define SMALL_FILE_CHUNKS 64        // Files of at most this many chunks use one socket and no writer thread
+#define BANDWIDTH_LIMIT 0           // KiB/s shared by every download, 0 = unlimited
+#define BANDWIDTH_BURST_MS 20       // Requests that may go out at once under BANDWIDTH_LIMIT
+#define RESCAN_INTERVAL_MS 1000     // Wait before scanning input.txt again after a pass that downloaded nothing
+#define ENDGAME_CHUNKS 32       // Missing chunks left when in-flight chunks are also requested on idle sockets
+#define ENDGAME_COPIES 2        // Sockets one chunk may be requested on during the end game
+#define SACK_BITMAP_BYTES 128   // Largest SACK bitmap of one OP_ACK (must not exceed server's)
+#define ACK_RING (SACK_BITMAP_BYTES * 8 * 2)    // Received seqs remembered above the cumulative ACK (ring of bits)
+#define ACK_EVERY 32            // Datagrams received before an ACK is sent at once
+#define DELAYED_ACK_MS 5        // Longest an ACK is held back
+#define ACK_HOLE_TIMEOUT_MS 1000    // A missing reply older than this is given up (its chunk is requested again)
+#define FEC_GROUP_SIZE 0        // Chunks per parity asked for: fixed, 0 = adapted to the loss rate, -1 = no FEC
+#define FEC_MAX_GROUP 16        // Largest FEC group (must not exceed server's)
+#define FEC_MIN_LOSS 0.005      // Loss rate under which no parity is asked for
+#define FEC_LOSS_TARGET 0.25    // Adapted group size = FEC_LOSS_TARGET / loss rate: a group rarely loses two chunks
+#define FEC_LOSS_WINDOW 4096    // Replies the loss rate is measured over (older ones weigh half as much)
+#define FEC_GROUPS 128          // FEC groups being rebuilt at once on one socket
+#define COMPRESSION COMPRESS_LZ4    // Codecs asked for in metadata and catalog requests, 0 = chunks always raw
 #define DOWNLOADS_DIR "downloads/"
-#define MAX_RETRIES 3
-#define RETRY_DELAY_MS 200
+#define MAX_RETRIES 6            // Metadata (and hash) requests sent again before giving up (with exponential backoff)
+#define RETRY_DELAY_MS 200      // Metadata RTO before the first RTT sample
+#define METADATA_WINDOW 16      // Hash or catalog page requests in flight on a metadata socket
+#define CATALOG_RESTARTS 3      // Catalog fetches started again when it changes between pages
+#define CATALOG_PENDING_WAIT_MS 200 // Wait before asking again for a catalog or metadata the server is still hashing
+#define CATALOG_PENDING_RETRIES 50  // Fetches of a pending catalog before using it without those files (metadata: giving up)
+#define VERIFY_THREADS 0        // Threads checking the chunks of a resumed download, 0 = one per CPU core
 #define MAX_FILENAME_LENGTH 256
+#define WRITE_QUEUE_BYTES (64 << 20)    // Received data waiting for the writer before a download stops requesting
+#define WRITE_QUEUE_RETRY_MS 5          // Check again for room in a full write queue
+#define MAX_WRITE_IOVECS 1024           // Chunks merged into one pwritev call (IOV_MAX)
+#define MAX_WRITE_FAILURES 8            // Failed writes a download downloads the chunks of again before giving up
+#define PREALLOCATE_SPARSE 0            // ftruncate: holes, blocks are allocated as chunks arrive
+#define PREALLOCATE_RESERVE 1           // fallocate: blocks reserved up front (falls back to sparse)
+#define PREALLOCATE_MODE PREALLOCATE_SPARSE
+#define JOURNAL_SUFFIX ".journal"      // downloads/<file>.journal: chunks already written, removed when complete
+#define JOURNAL_MAGIC "UDPJ"
+#define JOURNAL_VERSION 2
+#define JOURNAL_FLUSH_MS 1000           // How often written chunks are recorded in the journal
+
+// Wire protocol, must match server.h
+#define PROTOCOL_VERSION 6
 
-#define REQUEST_METADATA "REQUEST_METADATA"
-#define REQUEST_CHUNK "REQUEST_CHUNK"
-#define REPLY "REPLY"
+#define OP_REQUEST_METADATA 1   // Client -> Server, payload = requested chunk size (uint32) + filename, flags = codecs
+#define OP_REQUEST_CHUNK 2      // Client -> Server, file_handle + chunk_id
+#define OP_META 3               // Server -> Client, file_handle, payload = Metadata (with the root hash) + filename, flags = codec
+#define OP_CHUNK 4              // Server -> Client, file_handle + chunk_id, payload = chunk data (compressed if CHUNK_COMPRESSED)
+#define OP_ACK 5                // Client -> Server, seq = cumulative ACK, payload = SACK bitmap (bit i => seq + 1 + i)
+#define OP_ERROR 6              // Server -> Client, seq = NO_SEQ, payload = error message
+#define OP_REQUEST_CHUNKS 7     // Client -> Server, file_handle + first chunk_id, payload = pacing rate (uint32 KiB/s) + bitmap (bit i => chunk_id + i)
+#define OP_REQUEST_HASHES 8     // Client -> Server, file_handle + first leaf of the hash tree
+#define OP_HASHES 9             // Server -> Client, file_handle + first leaf, payload = leaf hashes (as many as fit one chunk)
+#define OP_REQUEST_CATALOG 10   // Client -> Server, chunk_id = page, payload = chunk size the handles are for (uint32), flags = codecs
+#define OP_CATALOG 11           // Server -> Client, chunk_id = page, payload = CatalogPage + (CatalogEntry + name)...
+#define OP_PARITY 12            // Server -> Client, file_handle + first chunk_id, flags = members (bit i => chunk_id + i), payload = XOR of them
+
+#define COMPRESS_LZ4 0x0001     // Codec: LZ4 block format (common/lz4.h)
+#define CHUNK_COMPRESSED 0x8000 // OP_CHUNK flags: payload is compressed, the rest is its place in its FEC group
+#define CATALOG_PENDING 0x0001  // OP_CATALOG flags: files of the page left out until the server has hashed them
+#define META_PENDING 0x4000     // OP_META flags: the server has not hashed the file yet, ask again later
+#define NO_SEQ UINT64_MAX       // Seq of replies the server sends once (OP_ERROR, pending OP_META): never acknowledged
 
 #pragma pack(push, 1)
+struct PacketHeader {
+    uint8_t version;         // PROTOCOL_VERSION
+    uint8_t opcode;          // OP_*
+    uint16_t flags;          // Requests: codecs / FEC group size, OP_META: codec, OP_CHUNK: compressed + place in its group, OP_PARITY: members
+    uint32_t file_handle;    // Handle given by OP_META, 0 = none
+    uint64_t chunk_id;       // Chunk index for chunk packets
+    uint64_t seq;            // Reply sequence number (acknowledged by OP_ACK)
+    uint32_t length;         // Payload length
+    uint32_t crc;            // CRC32 of header (with crc = 0) + payload
+};
+
 struct Metadata {
     uint64_t file_size;
     uint64_t num_chunks;
     uint64_t chunk_size;
+    uint8_t root_hash[SHA256_SIZE];     // Root of the chunk hash tree (common/merkle.h)
+};
+
+struct CatalogPage {
+    uint64_t generation;     // Catalog version, every page of one fetch must have the same
+    uint32_t page_count;
+    uint32_t entry_count;    // CatalogEntry + name, entry_count times
+};
+
+struct CatalogEntry {
+    uint32_t file_handle;    // Valid for the chunk size asked for, as OP_META gives
+    uint64_t file_size;
+    uint64_t num_chunks;
+    uint64_t chunk_size;
+    uint64_t version;        // Modification time on the server (ns)
+    uint8_t root_hash[SHA256_SIZE];
+    uint16_t name_len;
 };
+#pragma pack(pop)             // Wire structs only: mutexes below must stay aligned
 
 struct ReceivedChunk {
     uint64_t id;
@@ -72,12 +177,145 @@ struct ReceivedChunk {
     }
 };
 
-struct ThreadTracker {
+/// @brief To use to share the chunks of one download between its sockets. Each socket starts with a
+/// contiguous range; a socket with nothing left to request steals half of the largest backlog, and
+/// the last ENDGAME_CHUNKS missing chunks are also requested on a second socket
+struct ChunkScheduler {
     uint64_t total_chunk = 0;
-    uint64_t downloaded_chunk = 0;
-    std::set<uint64_t> downloading_chunk;
+    uint64_t missing_chunk = 0;                     // Not received yet
+    uint64_t corrupted_chunk = 0;                   // Received with a wrong hash (requested again)
+    uint64_t recovered_chunk = 0;                   // Lost and rebuilt from their FEC group
+    uint64_t compressed_chunk = 0;                  // Received compressed
+    uint64_t compress_saved = 0;                    // Bytes compression took off them
+    std::vector<bool> received;                     // Chunk id => received
+};
+
+/// @brief To use to track a chunk requested and not received yet
+struct RequestedChunk {
+    std::chrono::steady_clock::time_point sent_time;
+    bool retransmitted;     // Requested more than once, no RTT sample (Karn)
+    bool lost;              // Counted as lost, waiting to be requested again
+};
+
+/// @brief To use to acknowledge the replies received on one socket: cumulative ACK + SACK bitmap.
+/// Fixed size, recording a reply never allocates
+struct AckState {
+    uint64_t cumulative = 0;                        // Every reply seq below has been received
+    std::bitset<ACK_RING> received;                 // Bit seq % ACK_RING: seq received, for cumulative <= seq < cumulative + ACK_RING
+    uint32_t received_count = 0;                    // Bits set
+    uint32_t unacked = 0;                           // Datagrams received since the last ACK
+    std::chrono::steady_clock::time_point first_unacked{};  // When the oldest of them arrived
+    std::chrono::steady_clock::time_point last_advance = std::chrono::steady_clock::now();  // cumulative last moved
+};
+
+/// @brief To use to rebuild one lost chunk of an FEC group: the parity arrives first, then every member
+/// that arrives is XORed into it, and once all members but one are in, data is the missing one
+struct FecGroup {
+    uint64_t parity_seq = UINT64_MAX;               // Member at place j has seq parity_seq + j, UINT64_MAX = unused
+    uint64_t first_chunk = 0;
+    uint16_t members = 0;                           // Bit i => chunk first_chunk + i
+    uint16_t received = 0;                          // Bit j - 1 => member at place j XORed in
+    std::vector<char> data;                         // Grown once to the chunk size, then reused
+    size_t data_len = 0;
+};
+
+/// @brief To use to drive one socket of a download: chunks it is responsible for and requests in flight
+struct DownloadFlow {
+    int sock = -1;
+    size_t mirror = 0;                              // Server this socket downloads from (index in mirrors)
+    uint32_t file_handle = 0;                       // Handle of the file on that server
+    CongestionController* cc = nullptr;             // Congestion controller of that server's path
+    uint64_t received_chunk = 0;                    // Chunks received on this socket (progress display)
+    std::set<uint64_t> to_request;                  // Missing and not requested (or lost)
+    std::map<uint64_t, RequestedChunk> requested;   // Requested, waiting for the chunk
+    std::deque<std::pair<uint64_t, std::chrono::steady_clock::time_point>> request_order;   // Oldest request first
+    uint64_t in_flight = 0;                         // Requested, not received and not lost
+    AckState acks;
+    std::vector<FecGroup> fec_groups = std::vector<FecGroup>(FEC_GROUPS);  // Slot parity seq % FEC_GROUPS
+    int fec_waiting = -1;                           // Slot of a group missing its last member, rebuilt when a later reply
+    uint64_t fec_waiting_parity = 0;                // arrives (parity seq of that group)
+    uint64_t next_seq = 0;                          // Reply seq expected next: seqs skipped over are lost
+    double loss_received = 0;                       // Replies received and seqs skipped (FEC loss rate),
+    double loss_skipped = 0;                        // halved every FEC_LOSS_WINDOW replies
+};
+
+/// @brief On-disk header of a download journal, followed by the chunk bitmap (host byte order)
+struct JournalHeader {
+    char magic[4];           // JOURNAL_MAGIC
+    uint32_t version;        // JOURNAL_VERSION
+    uint64_t file_size;      // Metadata the bitmap was built against
+    uint64_t num_chunks;
+    uint64_t chunk_size;
+    uint8_t root_hash[SHA256_SIZE];
+};
+
+/// @brief To use to resume a download: bitmap of the chunks written to disk, kept in
+/// downloads/<file>.journal. A bit is set only after its chunk is written and synced
+struct DownloadJournal {
+    int fd = -1;
+    std::string path;
+    uint64_t num_chunks = 0;
+    std::vector<uint8_t> bitmap;                    // Bit i (LSB first) => chunk i written
+    uint64_t written_chunk = 0;                     // Bits set
+    size_t dirty_begin = SIZE_MAX, dirty_end = 0;   // Bitmap bytes changed since the last flush
+    std::chrono::steady_clock::time_point last_flush{};
 };
 
+/// @brief To use to write the chunks of one download through one fd, on its own thread.
+/// Receive threads only queue data; the writer sorts what is queued and merges adjacent chunks
+struct ChunkWriter {
+    int fd = -1;
+    uint64_t chunk_size = 0;
+    std::mutex mtx;                             // Protects queue, queued_bytes, closing, failed and write_failures
+    std::condition_variable not_empty;
+    std::vector<ReceivedChunk> queue;
+    std::vector<std::vector<char>> free_buffers;   // Written chunks' buffers, reused by the next pushes
+    size_t queued_bytes = 0;
+    std::vector<uint64_t> failed;               // Chunks whose write failed, to download again
+    uint64_t write_failures = 0;                // Failed writes since the download started
+    bool closing = false;
+    bool threaded = false;                      // false: chunks are written by the caller (small files)
+    std::thread thread;
+    DownloadJournal journal;                    // Only touched by the writer thread once it runs
+};
+
+/// @brief To use to run one file in a download event loop
+struct Download {
+    std::string filename;
+    bool has_metadata = false;
+    bool running = false;                       // Started and not finished
+    bool small = false;                         // At most SMALL_FILE_CHUNKS chunks
+    uint32_t file_handle = 0;
+    std::vector<uint32_t> mirror_handles;       // Handle on each mirror, 0 = it does not serve the same version
+    Metadata metadata{};
+    std::vector<Sha256Hash> chunk_hashes;       // Leaves of the hash tree, checked against metadata.root_hash
+    uint64_t missing_hashes = 0;                // Leaves not received yet
+    std::vector<std::unique_ptr<CongestionController>> ccs;     // Per mirror used: its sockets share its path
+    std::vector<int> mirror_flows;              // Sockets on each mirror
+    ChunkScheduler scheduler;
+    std::vector<DownloadFlow> flows;
+    ChunkWriter writer;
+    std::vector<char> inflated;                 // Chunk being decompressed (one chunk and some room for fast copies)
+};
+
+/// @brief To use to skip the metadata round trip of a file listed in the catalog. Replaced when the
+/// catalog shows another version, chunk hashes are kept once verified
+struct CachedMetadata {
+    uint32_t file_handle = 0;
+    std::vector<uint32_t> mirror_handles;       // Handle on each mirror whose catalog agrees (size, chunks, root hash), else 0
+    Metadata metadata{};
+    uint64_t version = 0;
+    std::vector<Sha256Hash> chunk_hashes;       // Empty until fetched (or set from the root for one chunk)
+};
+
+/// @brief To use to share BANDWIDTH_LIMIT between every download: token bucket of requestable bytes
+struct BandwidthBudget {
+    std::mutex mtx;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last_refill = std::chrono::steady_clock::now();
+};
+
+#pragma pack(push, 1)
 struct AckPacket {
     char type; // 'A' for ACK
     uint64_t seq_num;
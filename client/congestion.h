@@ -0,0 +1,196 @@
+// congestion.h
+// Congestion control of chunk requests. The client decides how many chunks are in flight
+// (requested, not received yet) and tells the server the rate to pace its replies at.
+// Controllers are pluggable: AIMD (Reno-like) and CUBIC, chosen by name (CONGESTION_CONTROL).
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <algorithm>
+#include "../common/rtt.h"
+
+#define CONGESTION_CONTROL "cubic"  // "cubic" or "aimd"
+#define INITIAL_WINDOW 16           // Chunks in flight before the first RTT sample
+#define MIN_WINDOW 2
+#define MAX_WINDOW 8192
+#define PACING_GAIN 1.25            // Pace a bit faster than cwnd / srtt so the window can fill
+#define INITIAL_RTO_MS 300          // RTO before the first RTT sample
+#define MIN_RTO_MS 50
+#define MAX_RTO_MS 2000
+
+/// @brief Base of every congestion controller: window bookkeeping, RTT estimate (RttEstimator) and loss epochs.
+/// Shared by the download threads of one file, every public method takes the lock.
+class CongestionController {
+public:
+    using clock = std::chrono::steady_clock;
+
+    virtual ~CongestionController() = default;
+    virtual const char* name() const = 0;
+
+    /// @brief Number of chunks that may be requested now
+    uint64_t available() {
+        std::lock_guard<std::mutex> lock(mtx);
+        uint64_t window = (uint64_t)cwnd;
+        return window > in_flight ? window - in_flight : 0;
+    }
+
+    /// @brief Chunks have been requested
+    void on_send(uint64_t chunks) {
+        std::lock_guard<std::mutex> lock(mtx);
+        in_flight += chunks;
+    }
+
+    /// @brief A requested chunk arrived. rtt_ms < 0 when the chunk was requested more than once (no sample)
+    void on_ack(double rtt_ms, clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mtx);
+        in_flight -= std::min<uint64_t>(in_flight, 1);
+        if (rtt_ms >= 0) {
+            rtt.sample(rtt_ms);
+        }
+        if (cwnd < ssthresh) {
+            cwnd += 1;                   // Slow start: double every RTT
+        } else {
+            increase(now);
+        }
+        cwnd = std::min<double>(cwnd, MAX_WINDOW);
+    }
+
+    /// @brief A requested chunk is no longer expected (it arrived through another request)
+    void on_cancel() {
+        std::lock_guard<std::mutex> lock(mtx);
+        in_flight -= std::min<uint64_t>(in_flight, 1);
+    }
+
+    /// @brief A requested chunk did not arrive within the RTO. Only one reduction (and one RTO
+    /// backoff) per RTT: chunks requested before the last reduction belong to the same loss event
+    void on_loss(clock::time_point sent_time, clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mtx);
+        in_flight -= std::min<uint64_t>(in_flight, 1);
+        if (sent_time <= recovery_start) {
+            return;
+        }
+        recovery_start = now;
+        rtt.on_timeout();
+        decrease(now);
+        cwnd = std::max<double>(cwnd, MIN_WINDOW);
+        ssthresh = std::max<double>(ssthresh, MIN_WINDOW);
+    }
+
+    /// @brief Time after which a requested chunk is considered lost
+    std::chrono::milliseconds rto() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return std::chrono::milliseconds((int64_t)rtt.rto_ms());
+    }
+
+    /// @brief Rate the server should pace replies at, in KiB/s, 0 before the first RTT sample
+    uint32_t pacing_rate(uint64_t chunk_size, int flows) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!rtt.has_sample) {
+            return 0;
+        }
+        double bytes_per_second = PACING_GAIN * cwnd * chunk_size / (rtt.srtt_ms / 1000.0) / std::max(1, flows);
+        return (uint32_t)std::min<double>(bytes_per_second / 1024, UINT32_MAX);
+    }
+
+    double window() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return cwnd;
+    }
+
+protected:
+    /// @brief Congestion avoidance, called once per received chunk
+    virtual void increase(clock::time_point now) = 0;
+    /// @brief Reaction to a loss event, must set cwnd and ssthresh
+    virtual void decrease(clock::time_point now) = 0;
+
+    double cwnd = INITIAL_WINDOW;           // Chunks
+    double ssthresh = MAX_WINDOW;           // Slow start until the first loss
+    RttEstimator rtt{INITIAL_RTO_MS, MIN_RTO_MS, MAX_RTO_MS};
+
+private:
+    std::mutex mtx;
+    uint64_t in_flight = 0;
+    clock::time_point recovery_start{};     // Time of the last window reduction
+};
+
+/// @brief Additive increase (one chunk per RTT), multiplicative decrease (half)
+class AimdController : public CongestionController {
+public:
+    const char* name() const override { return "aimd"; }
+
+protected:
+    void increase(clock::time_point) override {
+        cwnd += 1 / cwnd;
+    }
+
+    void decrease(clock::time_point) override {
+        ssthresh = cwnd / 2;
+        cwnd = ssthresh;
+    }
+};
+
+/// @brief CUBIC (RFC 8312): window grows as a cubic function of the time since the last loss,
+/// never slower than what AIMD would reach in the same time (TCP-friendly region)
+class CubicController : public CongestionController {
+public:
+    const char* name() const override { return "cubic"; }
+
+protected:
+    static constexpr double C = 0.4;
+    static constexpr double BETA = 0.7;
+
+    void increase(clock::time_point now) override {
+        if (!in_epoch) {
+            // First congestion avoidance step after slow start or a loss
+            in_epoch = true;
+            epoch_start = now;
+            w_max = std::max(w_max, cwnd);
+            k = std::cbrt(w_max * (1 - BETA) / C);
+            w_est = cwnd;
+        }
+
+        double t = std::chrono::duration<double>(now - epoch_start).count() + rtt.srtt() / 1000.0;
+        double target = C * std::pow(t - k, 3) + w_max;
+
+        // AIMD estimate with the same average rate as Reno under CUBIC's beta
+        w_est += 3 * (1 - BETA) / (1 + BETA) / cwnd;
+
+        if (target < w_est) {
+            target = w_est;
+        }
+        if (target > cwnd) {
+            cwnd += std::min(target - cwnd, cwnd) / cwnd;   // At most doubles per RTT
+        } else {
+            cwnd += 0.01 / cwnd;
+        }
+    }
+
+    void decrease(clock::time_point) override {
+        // Fast convergence: give bandwidth back to newer flows when losing before reaching w_max
+        w_max = cwnd < w_max ? cwnd * (1 + BETA) / 2 : cwnd;
+        ssthresh = cwnd * BETA;
+        cwnd = ssthresh;
+        in_epoch = false;
+    }
+
+private:
+    bool in_epoch = false;
+    clock::time_point epoch_start{};
+    double w_max = 0;               // Window just before the last reduction
+    double k = 0;                   // Seconds to climb back to w_max
+    double w_est = 0;               // Window Reno would have
+};
+
+/// @brief Create a congestion controller by name, CUBIC if the name is unknown
+static inline std::unique_ptr<CongestionController> make_congestion_controller(const std::string& name) {
+    if (name == "aimd") {
+        return std::make_unique<AimdController>();
+    }
+    return std::make_unique<CubicController>();
+}
+
+#endif // CONGESTION_H
@@ -0,0 +1,252 @@
+// crc32.h
+// CRC32 (0xEDB88320 polynomial, same result as zlib) shared by server, client and crc32_bench.
+// init_crc_table() builds the tables and picks the fastest implementation supported by the CPU:
+// - PCLMULQDQ folding (x86_64)
+// - CRC32 instructions (ARMv8)
+// - slicing-by-16 / slicing-by-8 tables (portable)
+// - byte-at-a-time table (reference)
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL 1
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32_HAVE_ARMV8 1
+#endif
+
+/// @brief One CRC32 kernel: takes and returns the raw (not inverted) CRC register
+typedef uint32_t (*crc32_kernel)(uint32_t crc, const uint8_t* buf, size_t len);
+
+static uint32_t crc_tables[16][256];             // crc_tables[0] is the classic CRC32 table (2^8=256)
+static crc32_kernel crc32_impl = nullptr;        // Kernel chosen by init_crc_table()
+static const char* crc32_impl_name = "none";
+
+/// @brief Reference implementation, one table lookup per byte
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t* buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_tables[0][(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/// @brief Slicing-by-8: 8 independent table lookups per 8 bytes
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t* buf, size_t len) {
+    while (len >= 8) {
+        uint32_t one, two;
+        memcpy(&one, buf, 4);
+        memcpy(&two, buf + 4, 4);
+        one ^= crc;
+        crc = crc_tables[7][one & 0xFF] ^ crc_tables[6][(one >> 8) & 0xFF]
+            ^ crc_tables[5][(one >> 16) & 0xFF] ^ crc_tables[4][one >> 24]
+            ^ crc_tables[3][two & 0xFF] ^ crc_tables[2][(two >> 8) & 0xFF]
+            ^ crc_tables[1][(two >> 16) & 0xFF] ^ crc_tables[0][two >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    return crc32_bytewise(crc, buf, len);
+}
+
+/// @brief Slicing-by-16: 16 independent table lookups per 16 bytes
+static uint32_t crc32_slice16(uint32_t crc, const uint8_t* buf, size_t len) {
+    while (len >= 16) {
+        uint32_t w[4];
+        memcpy(w, buf, 16);
+        w[0] ^= crc;
+        crc = crc_tables[15][w[0] & 0xFF] ^ crc_tables[14][(w[0] >> 8) & 0xFF]
+            ^ crc_tables[13][(w[0] >> 16) & 0xFF] ^ crc_tables[12][w[0] >> 24]
+            ^ crc_tables[11][w[1] & 0xFF] ^ crc_tables[10][(w[1] >> 8) & 0xFF]
+            ^ crc_tables[9][(w[1] >> 16) & 0xFF] ^ crc_tables[8][w[1] >> 24]
+            ^ crc_tables[7][w[2] & 0xFF] ^ crc_tables[6][(w[2] >> 8) & 0xFF]
+            ^ crc_tables[5][(w[2] >> 16) & 0xFF] ^ crc_tables[4][w[2] >> 24]
+            ^ crc_tables[3][w[3] & 0xFF] ^ crc_tables[2][(w[3] >> 8) & 0xFF]
+            ^ crc_tables[1][(w[3] >> 16) & 0xFF] ^ crc_tables[0][w[3] >> 24];
+        buf += 16;
+        len -= 16;
+    }
+    return crc32_slice8(crc, buf, len);
+}
+#else
+// Slicing tables above are laid out for little endian loads
+#define crc32_slice8 crc32_bytewise
+#define crc32_slice16 crc32_bytewise
+#endif
+
+#ifdef CRC32_HAVE_PCLMUL
+/// @brief Carry-less multiplication folding (Intel "Fast CRC Computation Using PCLMULQDQ"),
+/// 64 bytes per round, then Barrett reduction. Bytes that do not fill 16-byte blocks use slicing-by-8.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t* buf, size_t len) {
+    if (len < 64) {
+        return crc32_slice8(crc, buf, len);
+    }
+
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    size_t tail = len & 15;
+    len -= tail;
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    buf += 64;
+    len -= 64;
+
+    // Fold 4 blocks of 16 bytes in parallel
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    // Fold the 4 blocks into one
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Fold remaining blocks of 16 bytes
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = _mm_extract_epi32(x1, 1);
+    return crc32_slice8(crc, buf, tail);
+}
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+/// @brief ARMv8 CRC32 instructions (same polynomial as 0xEDB88320), 8 bytes per instruction
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t* buf, size_t len) {
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc = __crc32d(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32b(crc, *buf++);
+    }
+    return crc;
+}
+#endif
+
+/// @brief create CRC32 looking tables using 0xEDB88320 polynomial and choose the fastest kernel
+static inline void init_crc_table() {
+    uint32_t polynomial = 0xEDB88320;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (size_t j = 0; j < 8; j++) {
+            if (c & 1)
+                c = polynomial ^ (c >> 1);
+            else
+                c = c >> 1;
+        }
+        crc_tables[0][i] = c;
+    }
+    for (int k = 1; k < 16; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = crc_tables[k - 1][i];
+            crc_tables[k][i] = (c >> 8) ^ crc_tables[0][c & 0xFF];
+        }
+    }
+
+    crc32_impl = crc32_slice16;
+    crc32_impl_name = "slice16";
+#ifdef CRC32_HAVE_PCLMUL
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        crc32_impl = crc32_pclmul;
+        crc32_impl_name = "pclmul";
+    }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32_impl = crc32_armv8;
+        crc32_impl_name = "armv8";
+    }
+#endif
+}
+
+/// @brief calculate crc32 checksum for a string data
+static inline uint32_t crc32(const char* buf, size_t len) {
+    return crc32_impl(0xFFFFFFFF, (const uint8_t*)buf, len) ^ 0xFFFFFFFF;
+}
+
+#endif // CRC32_H
@@ -0,0 +1,92 @@
+// crc32_bench.cpp
+// Compare CRC32 kernels from crc32.h on packet sizes from 64 B to 64 KB.
+// Build: g++ -std=c++17 -O2 crc32_bench.cpp -o crc32_bench
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <random>
+#include "crc32.h"
+
+#define BENCH_MIN_SIZE 64
+#define BENCH_MAX_SIZE 65536
+#define BENCH_TIME_MS 200      // Time spent on each (kernel, size) pair
+
+struct Kernel {
+    const char* name;
+    crc32_kernel fn;
+};
+
+int main() {
+    init_crc_table();
+
+    std::vector<Kernel> kernels = {
+        {"bytewise", crc32_bytewise},
+        {"slice8", crc32_slice8},
+        {"slice16", crc32_slice16},
+    };
+#ifdef CRC32_HAVE_PCLMUL
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        kernels.push_back({"pclmul", crc32_pclmul});
+    }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        kernels.push_back({"armv8", crc32_armv8});
+    }
+#endif
+
+    // Random data, every kernel must agree with the reference on every length
+    std::vector<uint8_t> data(BENCH_MAX_SIZE + 64);
+    std::mt19937 rng(12345);
+    for (uint8_t& byte : data) {
+        byte = rng();
+    }
+    for (size_t len = 0; len <= 1024; len++) {
+        for (size_t offset = 0; offset < 8; offset++) {
+            uint32_t expected = crc32_bytewise(0xFFFFFFFF, data.data() + offset, len);
+            for (Kernel& kernel : kernels) {
+                if (kernel.fn(0xFFFFFFFF, data.data() + offset, len) != expected) {
+                    std::cerr << "Mismatch: " << kernel.name << " len " << len << " offset " << offset << "\n";
+                    return 1;
+                }
+            }
+        }
+    }
+
+    if (crc32("123456789", 9) != 0xCBF43926) {
+        std::cerr << "Wrong check value for selected kernel " << crc32_impl_name << "\n";
+        return 1;
+    }
+
+    std::cout << "Selected kernel: " << crc32_impl_name << "\n";
+    std::cout << std::setw(8) << "size";
+    for (Kernel& kernel : kernels) {
+        std::cout << std::setw(12) << kernel.name;
+    }
+    std::cout << "   (MB/s)\n";
+
+    for (size_t size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 2) {
+        std::cout << std::setw(8) << size;
+        for (Kernel& kernel : kernels) {
+            uint64_t bytes = 0;
+            uint32_t sink = 0;
+            auto start = std::chrono::steady_clock::now();
+            auto elapsed = std::chrono::steady_clock::duration::zero();
+
+            while (elapsed < std::chrono::milliseconds(BENCH_TIME_MS)) {
+                for (int i = 0; i < 64; i++) {
+                    sink ^= kernel.fn(0xFFFFFFFF, data.data(), size);
+                }
+                bytes += 64 * size;
+                elapsed = std::chrono::steady_clock::now() - start;
+            }
+
+            double seconds = std::chrono::duration<double>(elapsed).count();
+            std::cout << std::setw(12) << std::fixed << std::setprecision(0) << bytes / seconds / 1e6;
+            if (sink == 0x12345678) std::cout << " ";      // Keep results alive
+        }
+        std::cout << "\n";
+    }
+    return 0;
+}
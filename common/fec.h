@@ -0,0 +1,30 @@
+// fec.h
+// XOR forward error correction of chunk groups, shared by server and client:
+// - the chunks of one OP_REQUEST_CHUNKS are split into groups of up to the asked group size, members within
+//   FEC_MAX_GROUP ids of each other (the member bitmap is the 16-bit header flags)
+// - OP_PARITY = XOR of the members (shorter ones padded with zeros), sent just before them; member at place j
+//   (1..n, its header flags) has the seq of the parity + j
+// - any one lost member = parity XOR the others: rebuilt without a round trip, and acknowledged as received
+#ifndef FEC_H
+#define FEC_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/// @brief dst ^= src over len bytes, eight at a time
+static inline void fec_xor(char* dst, const char* src, size_t len) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+#endif // FEC_H
@@ -0,0 +1,226 @@
+// lz4.h
+// LZ4 block format (the format of the reference lz4 library's LZ4_compress_default / LZ4_decompress_safe),
+// shared by server and client to compress chunks one by one:
+// - sequence = token (literal length << 4 | match length - 4), longer lengths go on in 255-bytes,
+//   the literals, a 2-byte little-endian offset back into the output, then the rest of the match length
+// - the last sequence is literals only: the last LZ4_LAST_LITERALS bytes are never part of a match,
+//   and no match starts in the last LZ4_MATCH_LIMIT bytes
+// Greedy single-pass compressor (one hash table entry per 4-byte hash, match search gives up faster
+// the longer it finds nothing), so incompressible data costs little. The decompressor checks every
+// length and offset against both buffers: a damaged or hostile block is rejected, never overruns.
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12            // 4096 entries: 16 KB of table, fits L1 with the chunk
+#define LZ4_SKIP_TRIGGER 6          // Search step grows by one every 2^6 failed searches
+
+/// @brief Largest block lz4_compress may write for len bytes (incompressible input)
+static inline size_t lz4_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static inline uint32_t lz4_read32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/// @brief Write the rest of a length that did not fit its 4 token bits (255-bytes then the remainder)
+static inline char* lz4_write_length(char* op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = (char)255;
+    }
+    *op++ = (char)len;
+    return op;
+}
+
+/// @brief Write one sequence: literals [anchor, anchor + literals), then a match (offset 0 = last sequence, no match).
+/// Return the end of the output, nullptr if it would pass out_end
+static inline char* lz4_write_sequence(char* op, char* out_end, const char* anchor, size_t literals,
+                                       size_t offset, size_t match_len) {
+    size_t match_code = offset != 0 ? match_len - LZ4_MIN_MATCH : 0;
+    size_t need = 1 + (literals >= 15 ? literals / 255 + 1 : 0) + literals
+                + (offset != 0 ? 2 + (match_code >= 15 ? match_code / 255 + 1 : 0) : 0);
+    if (need > (size_t)(out_end - op)) {
+        return nullptr;
+    }
+
+    char* token = op++;
+    *token = (char)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) {
+        op = lz4_write_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (offset == 0) {
+        return op;
+    }
+
+    *op++ = (char)(offset & 0xFF);
+    *op++ = (char)(offset >> 8);
+    *token |= (char)(match_code >= 15 ? 15 : match_code);
+    if (match_code >= 15) {
+        op = lz4_write_length(op, match_code - 15);
+    }
+    return op;
+}
+
+/// @brief Compress src into dst (at most dst_cap bytes). Return the compressed length,
+/// 0 if it does not fit dst_cap (a cap below len makes "not worth it" fail early)
+static inline size_t lz4_compress(const char* src, size_t len, char* dst, size_t dst_cap) {
+    uint32_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const char* ip = src;
+    const char* anchor = src;
+    const char* end = src + len;
+    char* op = dst;
+    char* out_end = dst + dst_cap;
+
+    if (len > LZ4_MATCH_LIMIT) {
+        const char* match_limit = end - LZ4_MATCH_LIMIT;
+        const char* extend_limit = end - LZ4_LAST_LITERALS;
+        uint32_t searches = 1 << LZ4_SKIP_TRIGGER;
+        ip++;
+
+        while (ip < match_limit) {
+            uint32_t sequence = lz4_read32(ip);
+            uint32_t hash = lz4_hash(sequence);
+            const char* ref = src + table[hash];
+            table[hash] = (uint32_t)(ip - src);
+
+            // Stale or colliding entries are only candidates: the bytes decide
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != sequence) {
+                ip += searches++ >> LZ4_SKIP_TRIGGER;
+                continue;
+            }
+            searches = 1 << LZ4_SKIP_TRIGGER;
+
+            // Grow the match backwards over pending literals, then forwards
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const char* match_end = ip + LZ4_MIN_MATCH;
+            size_t distance = ip - ref;
+            while (match_end + sizeof(uint64_t) <= extend_limit) {
+                uint64_t a, b;
+                memcpy(&a, match_end, sizeof(a));
+                memcpy(&b, match_end - distance, sizeof(b));
+                if (a != b) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                    match_end += __builtin_ctzll(a ^ b) / 8;     // First differing byte
+#else
+                    match_end += __builtin_clzll(a ^ b) / 8;
+#endif
+                    break;
+                }
+                match_end += sizeof(uint64_t);
+            }
+            while (match_end < extend_limit && *match_end == match_end[-distance]) {
+                match_end++;
+            }
+
+            op = lz4_write_sequence(op, out_end, anchor, ip - anchor, distance, match_end - ip);
+            if (op == nullptr) {
+                return 0;
+            }
+            ip = anchor = match_end;
+
+            // The match end is a likely start of the next one
+            if (ip - 2 > src && ip < match_limit) {
+                table[lz4_hash(lz4_read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+            }
+        }
+    }
+
+    op = lz4_write_sequence(op, out_end, anchor, end - anchor, 0, 0);
+    return op != nullptr ? op - dst : 0;
+}
+
+/// @brief Decompress a block of len bytes into dst (at most dst_cap bytes, the ones past the result may be
+/// overwritten too). Return the decompressed length, SIZE_MAX if the block is malformed or does not fit dst_cap
+static inline size_t lz4_decompress(const char* src, size_t len, char* dst, size_t dst_cap) {
+    const uint8_t* ip = (const uint8_t*)src;
+    const uint8_t* end = ip + len;
+    char* op = dst;
+    char* out_end = dst + dst_cap;
+
+    // Length continued in 255-bytes, SIZE_MAX if the block ends first
+    auto read_length = [&](size_t length) -> size_t {
+        uint8_t byte;
+        do {
+            if (ip >= end) {
+                return SIZE_MAX;
+            }
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return length;
+    };
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && (literals = read_length(literals)) == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(out_end - op)) {
+            return SIZE_MAX;
+        }
+        if (literals <= 16 && end - ip >= 16 && out_end - op >= 16) {
+            memcpy(op, ip, 16);     // Fixed size: inlined, the extra bytes are overwritten next
+        } else {
+            memcpy(op, ip, literals);
+        }
+        op += literals;
+        ip += literals;
+        if (ip == end) {
+            break;      // Last sequence: literals only
+        }
+
+        if (end - ip < 2) {
+            return SIZE_MAX;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && (match_len = read_length(match_len)) == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match_len > (size_t)(out_end - op)) {
+            return SIZE_MAX;
+        }
+
+        // A match may overlap what it writes (offset < length repeats the last offset bytes):
+        // 8 bytes at a time when they are all written already, past the match end when there is room
+        const char* ref = op - offset;
+        char* match_end = op + match_len;
+        if (offset >= sizeof(uint64_t) && (size_t)(out_end - op) >= match_len + sizeof(uint64_t)) {
+            for (; op < match_end; op += sizeof(uint64_t), ref += sizeof(uint64_t)) {
+                memcpy(op, ref, sizeof(uint64_t));
+            }
+        } else {
+            for (; op < match_end; op++, ref++) {
+                *op = *ref;
+            }
+        }
+        op = match_end;
+    }
+    return op - dst;
+}
+
+#endif // LZ4_H
@@ -0,0 +1,96 @@
+// merkle.h
+// Hash tree of a file, shared by server and client:
+// - leaf i = SHA-256(0x00 || chunk i), node = SHA-256(0x01 || left || right) (no leaf/node confusion)
+// - a node without a right sibling moves up unchanged
+// - root of an empty file = SHA-256 of nothing
+// The server sends the root in OP_META and the leaves in OP_HASHES; the client checks the leaves
+// against the root once, then every chunk against its leaf before writing it.
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <unistd.h>
+#include "sha256.h"
+
+#define MERKLE_LEAF 0x00
+#define MERKLE_NODE 0x01
+
+/// @brief Hash of one chunk
+static inline Sha256Hash merkle_leaf(const char* data, size_t len) {
+    uint8_t prefix = MERKLE_LEAF;
+    Sha256 ctx;
+    ctx.update(&prefix, 1);
+    ctx.update(data, len);
+    return ctx.final();
+}
+
+/// @brief Hash of two children
+static inline Sha256Hash merkle_node(const Sha256Hash& left, const Sha256Hash& right) {
+    uint8_t prefix = MERKLE_NODE;
+    Sha256 ctx;
+    ctx.update(&prefix, 1);
+    ctx.update(left.data(), left.size());
+    ctx.update(right.data(), right.size());
+    return ctx.final();
+}
+
+/// @brief Root hash over the leaves, level by level
+static inline Sha256Hash merkle_root(std::vector<Sha256Hash> level) {
+    if (level.empty()) {
+        return sha256("", 0);
+    }
+    while (level.size() > 1) {
+        size_t parents = (level.size() + 1) / 2;
+        for (size_t i = 0; i < parents; i++) {
+            level[i] = 2 * i + 1 < level.size() ? merkle_node(level[2 * i], level[2 * i + 1]) : level[2 * i];
+        }
+        level.resize(parents);
+    }
+    return level[0];
+}
+
+/// @brief Leaf hashes of the first size bytes of an open file, read with pread and split between threads
+/// (0 = one per CPU core). Return false if the file ends first (truncated while hashed)
+static inline bool merkle_leaves(int fd, size_t size, size_t chunk_size, std::vector<Sha256Hash>& leaves, unsigned threads = 0) {
+    size_t num_chunks = (size + chunk_size - 1) / chunk_size;
+    leaves.assign(num_chunks, Sha256Hash{});
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = (unsigned)std::min<size_t>(threads, std::max<size_t>(1, num_chunks));
+
+    std::atomic<bool> complete{true};
+    auto hash_range = [&](unsigned part) {
+        std::vector<char> chunk(chunk_size);
+        for (size_t i = part; i < num_chunks && complete; i += threads) {
+            size_t len = std::min(chunk_size, size - i * chunk_size);
+            for (size_t done = 0; done < len; ) {
+                ssize_t ret = pread(fd, chunk.data() + done, len - done, i * chunk_size + done);
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ret <= 0) {
+                    complete = false;
+                    return;
+                }
+                done += ret;
+            }
+            leaves[i] = merkle_leaf(chunk.data(), len);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned part = 1; part < threads; part++) {
+        workers.emplace_back(hash_range, part);
+    }
+    hash_range(0);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return complete;
+}
+
+#endif // MERKLE_H
@@ -0,0 +1,62 @@
+// rtt.h
+// Retransmission timeout from measured round-trip times (RFC 6298), shared by server and client:
+// - Jacobson/Karels smoothing: srtt += (rtt - srtt) / 8, rttvar += (|srtt - rtt| - rttvar) / 4
+// - RTO = srtt + 4 * rttvar + ack_delay_ms (longest the peer holds an ACK back), clamped to [min_ms, max_ms],
+//   initial_ms before the first sample
+// - Exponential backoff: a timeout doubles the RTO until the next sample
+// Karn's rule is up to the caller: never sample something that was sent more than once.
+#ifndef RTT_H
+#define RTT_H
+
+#include <algorithm>
+#include <cmath>
+
+#define RTT_MAX_BACKOFF 6           // RTO doubled at most 2^6 times (still capped at max_ms)
+
+/// @brief To use to estimate the RTO of one path (one session, one download)
+struct RttEstimator {
+    double initial_ms;
+    double min_ms;
+    double max_ms;
+    double ack_delay_ms;
+    double srtt_ms = 0;             // Smoothed RTT
+    double rttvar_ms = 0;           // RTT variation
+    bool has_sample = false;
+    int backoff = 0;                // Timeouts since the last sample
+
+    RttEstimator(double initial_ms, double min_ms, double max_ms, double ack_delay_ms = 0)
+        : initial_ms(initial_ms), min_ms(min_ms), max_ms(max_ms), ack_delay_ms(ack_delay_ms) {}
+
+    /// @brief New measurement (first transmission only, Karn)
+    void sample(double rtt_ms) {
+        if (!has_sample) {
+            srtt_ms = rtt_ms;
+            rttvar_ms = rtt_ms / 2;
+            has_sample = true;
+        } else {
+            rttvar_ms = 0.75 * rttvar_ms + 0.25 * std::fabs(srtt_ms - rtt_ms);
+            srtt_ms = 0.875 * srtt_ms + 0.125 * rtt_ms;
+        }
+        backoff = 0;
+    }
+
+    /// @brief A timeout expired: the next ones wait twice as long
+    void on_timeout() {
+        backoff = std::min(backoff + 1, RTT_MAX_BACKOFF);
+    }
+
+    /// @brief Smoothed RTT, initial_ms before the first sample
+    double srtt() const {
+        return has_sample ? srtt_ms : initial_ms;
+    }
+
+    /// @brief Current RTO (ms) with its backoff, retries = extra doublings for one resent item
+    double rto_ms(int retries = 0) const {
+        double base = has_sample ? srtt_ms + 4 * rttvar_ms + ack_delay_ms : initial_ms;
+        base = std::clamp(base, min_ms, max_ms);
+        int shift = std::min(backoff + std::max(retries, 0), RTT_MAX_BACKOFF);
+        return std::min(base * (1 << shift), max_ms);
+    }
+};
+
+#endif // RTT_H
@@ -0,0 +1,193 @@
+// sha256.h
+// SHA-256 (FIPS 180-4) shared by server and client for chunk and file hashes.
+// init_sha256() picks the fastest block function supported by the CPU:
+// - SHA extensions (x86_64 SHA-NI)
+// - portable C++ (reference)
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define SHA256_HAVE_SHANI 1
+#endif
+
+#define SHA256_SIZE 32              // Digest bytes
+#define SHA256_BLOCK 64             // Block bytes
+
+typedef std::array<uint8_t, SHA256_SIZE> Sha256Hash;
+
+/// @brief One SHA-256 block function: compresses blocks * 64 bytes into state
+typedef void (*sha256_kernel)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t sha256_rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/// @brief Reference implementation, one round at a time
+static void sha256_blocks_portable(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    for (; blocks > 0; blocks--, data += SHA256_BLOCK) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16
+                 | (uint32_t)data[4 * i + 2] << 8 | (uint32_t)data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25);
+            uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+            uint32_t s0 = sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22);
+            uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef SHA256_HAVE_SHANI
+/// @brief SHA extensions: two rounds per sha256rnds2, message schedule with sha256msg1/msg2
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // state (A..H) => ABEF and CDGH, the register layout of sha256rnds2
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);     // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);                                       // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                            // CDGH
+
+    for (; blocks > 0; blocks--, data += SHA256_BLOCK) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i w[4];       // Message words of the last four groups of four rounds
+
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), byte_swap);
+            } else {
+                // w[i % 4] still holds group i - 4, w[(i + 3) % 4] is group i - 1
+                __m128i next = _mm_add_epi32(_mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]),
+                                             _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+                w[i % 4] = _mm_sha256msg2_epu32(next, w[(i + 3) % 4]);
+            }
+            __m128i msg = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i*)&SHA256_K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    // ABEF and CDGH => state (A..H)
+    tmp = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+/// @brief CPU has SHA extensions (CPUID leaf 7, EBX bit 29) and SSE4.1
+static inline bool sha256_shani_supported() {
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29))
+        && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+static sha256_kernel sha256_impl = sha256_blocks_portable;     // Kernel chosen by init_sha256()
+static const char* sha256_impl_name = "portable";
+
+/// @brief Choose the fastest block function for this CPU
+static inline void init_sha256() {
+#ifdef SHA256_HAVE_SHANI
+    if (sha256_shani_supported()) {
+        sha256_impl = sha256_blocks_shani;
+        sha256_impl_name = "shani";
+    }
+#endif
+}
+
+/// @brief To use to hash data given in several pieces
+struct Sha256 {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t block[SHA256_BLOCK];
+    size_t block_len = 0;
+    uint64_t total_len = 0;
+
+    void update(const void* data, size_t len) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        total_len += len;
+        if (block_len > 0) {
+            size_t take = std::min(len, SHA256_BLOCK - block_len);
+            memcpy(block + block_len, bytes, take);
+            block_len += take;
+            bytes += take;
+            len -= take;
+            if (block_len < SHA256_BLOCK) {
+                return;
+            }
+            sha256_impl(state, block, 1);
+            block_len = 0;
+        }
+        // Whole blocks straight from the input
+        sha256_impl(state, bytes, len / SHA256_BLOCK);
+        bytes += len / SHA256_BLOCK * SHA256_BLOCK;
+        block_len = len % SHA256_BLOCK;
+        memcpy(block, bytes, block_len);
+    }
+
+    Sha256Hash final() {
+        // Padding: 0x80, zeros, then the message length in bits (big endian)
+        uint64_t bits = total_len * 8;
+        uint8_t padding[SHA256_BLOCK + 8] = {0x80};
+        size_t pad_len = (block_len < 56 ? 56 : 120) - block_len;
+        for (int i = 0; i < 8; i++) {
+            padding[pad_len + i] = (uint8_t)(bits >> (56 - 8 * i));
+        }
+        update(padding, pad_len + 8);
+
+        Sha256Hash digest;
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i] = (uint8_t)(state[i] >> 24);
+            digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+            digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+            digest[4 * i + 3] = (uint8_t)state[i];
+        }
+        return digest;
+    }
+};
+
+/// @brief SHA-256 of one buffer
+static inline Sha256Hash sha256(const void* data, size_t len) {
+    Sha256 ctx;
+    ctx.update(data, len);
+    return ctx.final();
+}
+
+#endif // SHA256_H
@@ -5,6 +5,11 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <netinet/udp.h>
 #include <limits>
 #include <time.h>
 #include <vector>
@@ -15,7 +20,16 @@
 #include <condition_variable>
 #include <chrono>
 #include <unordered_map>
+#include <list>
+#include <memory>
+#include <tuple>
+#include <algorithm>
 #include "server.h"
+#include "../common/crc32.h"
+#include "../common/rtt.h"
+#include "../common/merkle.h"
+#include "../common/fec.h"
+#include "../common/lz4.h"
 
 /*-------------------Structures-------------------*/
 #pragma pack(push, 1)         // No padding activated
@@ -24,71 +38,411 @@ struct Metadata {
     uint64_t file_size;      // Size of file
     uint64_t num_chunk;      // Number of chunk
     uint64_t chunk_size;     // Chunk size
+    uint8_t root_hash[SHA256_SIZE];     // Root of the chunk hash tree
+};
+
+/// @brief To use at the start of an OP_CATALOG reply
+struct CatalogPage {
+    uint64_t generation;     // Catalog version, pages of different generations do not fit together
+    uint32_t page_count;     // Pages of this generation
+    uint32_t entry_count;    // Entries in this page
+};
+
+/// @brief To use to describe one file in an OP_CATALOG reply (followed by its name)
+struct CatalogEntry {
+    uint32_t file_handle;    // Handle bound to the requested chunk size, as OP_META gives
+    uint64_t file_size;
+    uint64_t num_chunk;
+    uint64_t chunk_size;
+    uint64_t version;        // Modification time (ns): changes when the file does
+    uint8_t root_hash[SHA256_SIZE];
+    uint16_t name_len;
 };
 #pragma pack(pop)             // Release padding (normal mode)
 
-/// @brief To use to save and track (IP, port) pairs connected to this socket
-struct Connected_device {
-    in_addr_t IP_addr;       // IP address
-    in_port_t port;           // Port number
-    uint64_t *seq_number;     // Current ACK sequence number
+/// @brief To use to schedule the paced departure or a retransmission check of one pending packet
+struct TimerEntry {
+    uint64_t session_key;     // (IP, port) of the session owning the packet
+    uint64_t seq;             // Sequence number of the pending packet
+    uint64_t deadline;        // Tick when the packet leaves (paced) or times out
+};
+
+struct Worker;
+
+/// @brief To use to find due retransmissions without scanning every pending packet.
+/// Level 0 has one slot per tick, level 1 has one slot per WHEEL_SLOTS ticks and is
+/// cascaded into level 0 each time level 0 wraps around.
+struct TimerWheel {
+    std::list<TimerEntry> slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t current_tick = 0;                                              // Next tick to process
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t wake_tick = UINT64_MAX;                                        // No timer to process before this tick
+    Worker* owner = nullptr;                                                // Its timeout thread, woken by earlier timers
 };
 
 /// @brief To use to manage sent packets status
 struct PendingPacket {
     std::chrono::steady_clock::time_point send_time;
     int retry_count;
-    char buffer[BUFFER_SIZE];
-    size_t buffer_len;
+    std::list<TimerEntry>* timer_slot;              // Wheel slot holding the timer of this packet
+    std::list<TimerEntry>::iterator timer_it;       // Timer of this packet (to cancel it on ACK)
+    std::vector<char> buffer;                       // Whole datagram (up to MAX_PACKET_SIZE)
     sockaddr_in client_addr;
     bool needs_retry; // Add flag to manage retry
+    bool paced;                                     // Waiting for its departure time, not sent yet
+};
+
+/// @brief To use to save and track one (IP, port) pair connected to the server
+struct Session {
+    uint64_t next_seq = 0;                                      // Sequence number of the next reply
+    std::map<uint64_t, PendingPacket> pending_packets;          // Seq => reply waiting for ACK (ordered for cumulative ACKs)
+    uint64_t pacing_rate = 0;                                   // Bytes per second asked by the client, 0 = no pacing
+    std::chrono::steady_clock::time_point next_departure{};     // Earliest time the next reply may leave
+    uint64_t paced_queued = 0;                                  // Replies waiting for their departure (later ones queue behind)
+    RttEstimator rtt{ACK_TIMEOUT, MIN_RTO_MS, MAX_RTO_MS, PEER_ACK_DELAY_MS};      // RTO of this client, from ACKed replies
+    std::chrono::steady_clock::time_point last_active = std::chrono::steady_clock::now();  // Last reply, ACK or give-up
+};
+
+/// @brief Retransmission timeout of a reply of a session: RTO doubled once per resend of that reply
+std::chrono::microseconds session_rto(const Session& session, int retry_count) {
+    return std::chrono::microseconds((int64_t)(session.rtt.rto_ms(retry_count) * 1000));
+}
+
+/// @brief To use to split sessions over several locks, so concurrent clients do not contend
+struct SessionStripe {
+    std::mutex mtx;                                     // Protects sessions and timer_wheel
+    std::unordered_map<uint64_t, Session> sessions;     // (IP, port) => session
+    TimerWheel timer_wheel;                             // Retransmission timers of these sessions
+    std::chrono::steady_clock::time_point last_sweep{}; // Last time idle sessions were evicted
+};
+
+/// @brief To use to remember what a file handle refers to
+struct FileHandle {
+    std::string fullpath;     // Path of the file
+    uint32_t chunk_size;      // Chunk size negotiated with OP_REQUEST_METADATA
+    uint16_t codec;           // Codec chunks may be compressed with (COMPRESS_*), 0 = always raw
+};
+
+/// @brief To use to serve chunks of a file without reopening it. Chunks are read with pread, not mapped:
+/// a file truncated while served gives a short read instead of SIGBUS
+struct OpenFile {
+    int fd = -1;              // Opened file descriptor
+    size_t size = 0;          // File size at opening time
+    struct timespec mtime{};  // Modification time at opening time
+    uint32_t chunk_size = 0;  // Chunk size of the handle this file is opened for
+    uint16_t codec = 0;       // Codec of the handle, 0 = chunks sent raw
+
+    std::mutex compressed_mtx;                      // Mutex for the fields below
+    std::vector<std::vector<char>> compressed;      // Chunk => compressed data (empty: not compressed yet / sent raw),
+                                                    // never changed once set
+    std::vector<bool> raw_chunks;                   // Chunk => compressing it gained too little
+    size_t compressed_bytes = 0;                    // Share of COMPRESS_CACHE_BYTES held
+    uint32_t probed = 0;                            // Chunks compressed so far
+    uint32_t gained = 0;                            // ... and sent compressed
+
+    ~OpenFile();
+};
+
+/// @brief To use to keep the hash tree of a file (per chunk size) after it is closed
+struct HashTree {
+    std::vector<Sha256Hash> leaves;     // Chunk hashes
+    Sha256Hash root;
+    size_t size;                        // File size and modification time the tree was built from
+    struct timespec mtime;
+};
+
+/// @brief To use to list a served file in the catalog
+struct CatalogFile {
+    std::string name;
+    size_t size;
+    struct timespec mtime;
+    std::map<uint32_t, std::shared_ptr<const HashTree>> trees;     // Chunk size => hash tree of this version
+};
+
+/// @brief Published state of the catalog: read-only once given to requests, except for its page index
+struct CatalogSnapshot {
+    uint64_t generation = 0;
+    std::vector<CatalogFile> files;                                     // Name order
+    CatalogFile list;                                                   // DOWNLOAD_LIST as written for this generation
+    std::mutex pages_mtx;                                               // Mutex for page_starts
+    std::unordered_map<uint32_t, std::vector<size_t>> page_starts;      // Chunk size => first file of each page
+};
+
+/// @brief To use to track an open file inside the open-file table
+struct CachedFile {
+    std::shared_ptr<OpenFile> file;
+    std::chrono::steady_clock::time_point last_check;   // Last time size/mtime were verified
+    std::list<uint32_t>::iterator lru_it;               // Position in LRU list
+};
+
+/// @brief To use to queue datagrams and send them with a single sendmmsg call.
+/// With UDP GSO, consecutive datagrams to the same client are merged into one message
+/// (equal-size segments, only the last one may be shorter) that the kernel splits again.
+struct SendBatch {
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovecs[SEND_BATCH];
+    struct sockaddr_in addrs[SEND_BATCH];
+    char controls[SEND_BATCH][CMSG_SPACE(sizeof(uint16_t))];    // UDP_SEGMENT of each message
+    uint16_t segment_size[SEND_BATCH];                          // Size of the first datagram of each message
+    uint16_t segments[SEND_BATCH];                              // Datagrams merged in each message
+    bool closed[SEND_BATCH];                                    // Last segment was shorter, nothing can follow
+    char data[SEND_BATCH_BYTES];                                // Datagrams, back to back
+    size_t data_len = 0;
+    unsigned int count = 0;
+    bool gso = false;                                           // Socket supports UDP_SEGMENT
+};
+
+/// @brief To use to receive many datagrams with a single recvmmsg call
+struct RecvBatch {
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iovecs[RECV_BATCH];
+    struct sockaddr_in addrs[RECV_BATCH];
+    char buffers[RECV_BATCH][BUFFER_SIZE];
+};
+
+/// @brief To use to report activity of one worker
+struct WorkerStats {
+    std::atomic<uint64_t> received{0};        // Datagrams received
+    std::atomic<uint64_t> sent{0};            // Replies sent (first time)
+    std::atomic<uint64_t> retransmitted{0};   // Replies resent after ACK timeout
+    std::atomic<uint64_t> dropped{0};         // Replies given up after MAX_RETRIES
+    std::atomic<uint64_t> acked{0};           // Replies acknowledged by clients
+    std::atomic<uint64_t> fast_retransmitted{0}; // Replies resent because later ones were SACKed
+    std::atomic<uint64_t> paced{0};           // Replies held back to follow the pacing rate
+    std::atomic<uint64_t> shed{0};            // Chunks not sent because the pacing queue was full
+    std::atomic<uint64_t> parity{0};          // OP_PARITY replies (FEC groups) sent
+    std::atomic<uint64_t> compressed{0};      // Chunks sent compressed
+    std::atomic<uint64_t> compress_saved{0};  // Bytes compression took off them
+};
+
+/// @brief To use to run one receive loop on its own SO_REUSEPORT socket.
+/// Clients are hashed to workers by the kernel; client state lives in the shared session stripes.
+struct Worker {
+    int id;                                                                 // Worker index
+    int num_workers;                                                        // Timeout thread serves stripes id, id + num_workers, ...
+    int sock_fd = -1;                                                       // Socket bound to SERVER_PORT
+    bool gso = false;                                                       // Kernel supports UDP_SEGMENT on sock_fd
+    std::mutex timeout_mtx;                                                 // Mutex for timeout_cv and timer_armed
+    std::condition_variable timeout_cv;                                     // Condition variable
+    bool timer_armed = false;                                               // A wheel got a timer earlier than its wake_tick
+    std::unique_ptr<SendBatch> send_batch = std::make_unique<SendBatch>();   // Replies of the current receive round
+    std::vector<char> parity;                                               // XOR of the chunks of the current FEC group
+    std::vector<char> compressed;                                           // Compressed chunk that did not fit the cache
+    std::vector<char> chunks;                                               // Chunks read from disk (a whole FEC group)
+    WorkerStats stats;
 };
 
 /*-------------------Global variables-------------------*/
-static uint32_t crc_table[256];                                         // CRC32 table (2^8=256)
-time_t last_reload = INT16_MIN;                                         // -INF
-std::map<std::pair<in_addr_t, in_port_t>, uint64_t> connected_device;   // (IP, port) => ACK
 std::atomic<bool> running{true};                                        // Flag to control thread
-std::mutex packets_mtx;                                                 // Mutex for syncing
-std::condition_variable timeout_cv;                                     // Condition variable
-std::unordered_map<uint64_t, PendingPacket> pending_packets;
+std::mutex cache_mtx;                                                   // Mutex for file handles and open-file table
+std::map<std::tuple<std::string, uint32_t, uint16_t>, uint32_t> handle_by_path;   // (Fullpath, chunk size, codec) => file handle
+std::vector<FileHandle> file_handles;                                   // File handle - 1 => file
+std::unordered_map<uint32_t, CachedFile> file_cache;                    // File handle => open file
+std::list<uint32_t> file_lru;                                           // Most recently used first
+std::atomic<size_t> compressed_cache_bytes{0};                          // Compressed chunks kept by open files
+std::map<std::string, CatalogFile> catalog_index;                       // Files of DOWNLOAD_DIR by name (catalog thread only)
+std::mutex catalog_mtx;                                                 // Mutex for catalog and catalog_chunk_sizes
+std::shared_ptr<CatalogSnapshot> catalog;                               // Latest published catalog_index
+std::vector<uint32_t> catalog_chunk_sizes;                              // Chunk sizes catalog_index is hashed for, oldest first
+std::vector<uint32_t> catalog_hashed_sizes;                             // ... as of the last catalog_hash (catalog thread only)
+int catalog_wake_fd = -1;                                               // eventfd: a catalog request asked for a new chunk size
+SessionStripe session_stripes[SESSION_STRIPES];                         // Client sessions, striped by (IP, port)
 
 /*-------------------Functions-------------------*/
 /// @brief Convert from host order (Little endian/Big endian) to network order (Big endian)
 uint64_t htonll(uint64_t value);
-/// @brief Update list of files to download
-void update_list();
-/// @brief Return true if we need to refresh list
-bool isTimeout();
-/// @brief Convert from host order (Little endian/Big endian) to network order (Big endian)
-void handle_fullname_getter(char* fullpath, char* &filename);
-/// @brief Handle metadata requests (REQUEST_METADATA:filename)
-void handle_metadata_request(int server_sock, struct sockaddr_in &client_addr, socklen_t &client_len, char* buffer);
-/// @brief Handle chunk requests (REQUEST_CHUNK:filename:chunk_number)
-void handle_chunk_request(int server_sock, struct sockaddr_in &client_addr, socklen_t &client_len, char* buffer);
-/// @brief Handle all replies to clients
-void handle_reply_to_client(int server_sock, struct sockaddr_in &client_addr, socklen_t &client_len, char* buffer, size_t buffer_len);
-/// @brief Handle ACK reply from client
-void handle_reply_from_client(int server_sock, struct sockaddr_in &client_addr, socklen_t &client_len, char* buffer, size_t buffer_len);
+/// @brief Convert from network order (Big endian) to host order (Little endian/Big endian)
+uint64_t ntohll(uint64_t value);
+/// @brief Stat one entry of DOWNLOAD_DIR into catalog_index, return true if the index changed
+bool catalog_refresh(const std::string& name);
+/// @brief Rebuild catalog_index from a full scan of DOWNLOAD_DIR, return true if the index changed
+bool catalog_scan();
+/// @brief Build the hash trees catalog_index misses for catalog_chunk_sizes, return true if the index changed
+bool catalog_hash();
+/// @brief Build the hash trees a file misses for chunk_sizes, return true if it got any
+bool catalog_hash_file(const char* fullpath, CatalogFile& indexed, const std::vector<uint32_t>& chunk_sizes);
+/// @brief Hash tree the latest catalog has for a file version (name in DOWNLOAD_DIR, or DOWNLOAD_LIST), nullptr if none
+std::shared_ptr<const HashTree> catalog_tree(const std::string& name, uint32_t chunk_size, size_t size, const struct timespec& mtime);
+/// @brief Ask the catalog thread to hash the catalog for chunk_size too
+void catalog_want_chunk_size(uint32_t chunk_size);
+/// @brief Publish catalog_index as a new catalog generation and rewrite DOWNLOAD_LIST from it
+void catalog_publish();
+/// @brief Keep catalog_index up to date from inotify events on DOWNLOAD_DIR (full rescans without inotify)
+void catalog_watch_thread();
+/// @brief First file of each page of a catalog for chunk_size, computed once per snapshot
+const std::vector<size_t>& catalog_pages(CatalogSnapshot& snapshot, uint32_t chunk_size);
+/// @brief Get the handle of a file served with chunk_size and codec, a new one is given the first time they are seen
+uint32_t file_handle_get(const char* fullpath, uint32_t chunk_size, uint16_t codec = 0);
+/// @brief Chunk size a requested one is served with (0 = CHUNK_SIZE), rounded down to an allowed size
+uint32_t chunk_size_allowed(uint32_t requested);
+/// @brief Codec to serve a file with among the ones a client accepts, 0 for content that is compressed already
+uint16_t compress_codec(const char* filename, uint16_t accepted);
+/// @brief Compressed data of a chunk (len = its size, set to the compressed size), nullptr if it is sent raw
+const char* chunk_compressed(Worker& worker, OpenFile& file, uint64_t chunk_index, const char* data, size_t& len);
+/// @brief Get an open file from open-file table, (re)open it if missing or changed on disk
+std::shared_ptr<OpenFile> file_cache_get(uint32_t file_handle, bool force_check = false);
+/// @brief Drop a file from open-file table (closed when the last user is done)
+void file_cache_invalidate(const char* fullpath);
+/// @brief Read chunk_index of a file into buffer (len = its size), false if the file is shorter than when opened
+bool file_read_chunk(const OpenFile& file, uint64_t chunk_index, char* buffer, size_t& len);
+/// @brief Forget a file handle whose file no longer matches what was opened (shrunk while served)
+void file_changed(uint32_t file_handle);
+/// @brief Path of a requested file name, false if the name could reach outside DOWNLOAD_DIR
+bool handle_fullname_getter(char* fullpath, char* &filename);
+/// @brief Handle metadata requests (OP_REQUEST_METADATA, payload = filename)
+void handle_metadata_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header, char* payload);
+/// @brief Handle chunk requests (OP_REQUEST_CHUNK, file handle + chunk id)
+void handle_chunk_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header);
+/// @brief Handle batch chunk requests (OP_REQUEST_CHUNKS, file handle + first chunk id, payload = pacing rate + bitmap)
+void handle_chunks_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header, char* payload);
+/// @brief Handle hash requests (OP_REQUEST_HASHES, file handle + first leaf)
+void handle_hashes_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header);
+/// @brief Handle catalog requests (OP_REQUEST_CATALOG, page, payload = chunk size)
+void handle_catalog_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header, char* payload);
+/// @brief Hash tree of the version of a file opened for a handle, from the catalog thread. nullptr if it is not built
+/// yet: the catalog thread is asked for it, requests never hash
+std::shared_ptr<const HashTree> file_hash_tree(uint32_t file_handle, const OpenFile& file);
+/// @brief Set the rate replies to a client are paced at (0 = send at once)
+void session_set_pacing(const sockaddr_in& client_addr, uint64_t pacing_rate);
+/// @brief How long a new reply to a client would wait for its paced departure
+std::chrono::steady_clock::duration session_pacing_delay(const sockaddr_in& client_addr);
+/// @brief Read and send one chunk of a file (chunk_index must be in range), false if the file changed
+bool send_chunk(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, uint32_t file_handle, OpenFile& file,
+                uint64_t chunk_index);
+/// @brief Send one chunk already read (len bytes at data), group_position = place in its FEC group (0 = none)
+void send_chunk_data(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, uint32_t file_handle, OpenFile& file,
+                     uint64_t chunk_index, const char* data, size_t len, uint16_t group_position = 0);
+/// @brief Send one FEC group: its parity, then its chunks (members = bit i => chunk first + i), false if the file changed
+bool send_chunk_group(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, uint32_t file_handle, OpenFile& file,
+                      uint64_t first, uint16_t members);
+/// @brief Handle all replies to clients (chunks may be shed by pacing unless may_shed is false)
+void handle_reply_to_client(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len,
+                            uint8_t opcode, uint32_t file_handle, uint64_t chunk_id, const char* payload, size_t payload_len,
+                            uint16_t flags = 0, bool may_shed = true);
+/// @brief Send a reply once, without a session or a seq (seq = NO_SEQ): errors and pending answers
+void handle_unsequenced_reply(Worker& worker, struct sockaddr_in &client_addr, uint8_t opcode, uint32_t file_handle,
+                              const char* payload, size_t payload_len, uint16_t flags = 0);
+/// @brief Send an OP_ERROR reply to client
+void handle_error_reply(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, char* message);
+/// @brief Handle ACK from client (OP_ACK, seq = cumulative ACK, payload = SACK bitmap)
+void handle_reply_from_client(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header, char* payload);
 /// @brief  Handle checking missing packets and resend them
-void timeout_checker_thread(int server_sock);
-/// @brief create CRC32 looking table using 0xEDB88320 polynomial
-void init_crc_table();
-/// @brief calculate crc32 checksum for a string data
-uint32_t crc32(char* buf, size_t len);
-/// @brief encode the message/data/buffer to 4-byte checksum and add to the message
-void encode_and_push_back(char* message, size_t& len);
-
-int main() {
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(sockaddr_in);
-    char buffer[BUFFER_SIZE];
+void timeout_checker_thread(Worker& worker);
+/// @brief Key of the session of a client address
+uint64_t session_key(const sockaddr_in& addr);
+/// @brief Stripe holding a session
+SessionStripe& session_stripe(uint64_t key);
+/// @brief Find a pending packet of a session, nullptr if it has been acknowledged. Stripe lock must be held
+PendingPacket* find_pending(SessionStripe& stripe, uint64_t key, uint64_t seq);
+/// @brief Evict the sessions of a stripe idle for SESSION_IDLE_TIMEOUT with nothing pending. Stripe lock must be held
+void session_sweep(SessionStripe& stripe, std::chrono::steady_clock::time_point now);
+/// @brief Convert a time point to a timer wheel tick (rounded up)
+uint64_t wheel_tick(TimerWheel& wheel, std::chrono::steady_clock::time_point time);
+/// @brief Put a timer of a pending packet into the wheel, wake its timeout thread if it is the earliest one
+void wheel_schedule(TimerWheel& wheel, PendingPacket& packet, TimerEntry entry);
+/// @brief First tick with a timer to process, UINT64_MAX if the wheel is empty
+uint64_t wheel_next_tick(const TimerWheel& wheel);
+/// @brief Process one tick of the wheel of a stripe, move its due timers into due
+void wheel_advance(SessionStripe& stripe, std::vector<TimerEntry>& due);
+/// @brief Create a UDP socket bound to SERVER_PORT that shares the port with other workers
+int create_worker_socket();
+/// @brief Return true if the kernel accepts UDP_SEGMENT (GSO) on this socket
+bool gso_supported(int sock_fd);
+/// @brief Receive loop of one worker
+void worker_thread(Worker& worker);
+/// @brief Print per-worker counters
+void print_stats(std::vector<std::unique_ptr<Worker>>& workers);
+/// @brief Queue a datagram to be sent, flush the batch first if it is full
+void batch_push(int sock_fd, SendBatch& batch, const sockaddr_in& addr, const char* data, size_t len);
+/// @brief Send every queued datagram with sendmmsg
+void batch_flush(int sock_fd, SendBatch& batch);
+/// @brief Build a datagram (header + payload) into message, return its total length
+size_t build_packet(char* message, uint8_t opcode, uint32_t file_handle, uint64_t chunk_id, uint64_t seq,
+                    const char* payload, size_t payload_len, uint16_t flags = 0);
+/// @brief Check version, length and CRC of a datagram, fill header in host order. Return false if it must be dropped
+bool parse_packet(char* message, size_t len, PacketHeader& header);
+
+int main(int argc, char* argv[]) {
+    init_crc_table();
+    init_sha256();
+
+    // Number of workers: ./server [num_workers], 0 means one per CPU core
+    int num_workers = (argc > 1) ? atoi(argv[1]) : NUM_WORKERS;
+    if (num_workers <= 0) {
+        num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < num_workers; i++) {
+        auto worker = std::make_unique<Worker>();
+        worker->id = i;
+        worker->num_workers = num_workers;
+        worker->sock_fd = create_worker_socket();
+        if (worker->sock_fd < 0) {
+            for (auto& w : workers) close(w->sock_fd);
+            return 404;
+        }
+        worker->gso = gso_supported(worker->sock_fd);
+        worker->send_batch->gso = worker->gso;
+        workers.push_back(std::move(worker));
+    }
+
+    // Timeout thread i serves stripes i, i + num_workers, ...
+    for (int stripe_id = 0; stripe_id < SESSION_STRIPES; stripe_id++) {
+        session_stripes[stripe_id].timer_wheel.owner = workers[stripe_id % num_workers].get();
+    }
+
+    std::cout << "UDP Server is running on port: " << SERVER_PORT << " with " << num_workers << " worker(s)"
+              << (workers[0]->gso ? " (UDP GSO)" : "") << "...\n";
+
+    // Catalog in memory before the first request, then kept up to date (and hashed) by its own thread
+    catalog_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    catalog_scan();
+    catalog_publish();
+
+    // Start workers, each one with its own timeout thread
+    std::vector<std::thread> threads;
+    threads.emplace_back(catalog_watch_thread);
+    for (auto& worker : workers) {
+        threads.emplace_back(worker_thread, std::ref(*worker));
+        threads.emplace_back(timeout_checker_thread, std::ref(*worker));
+    }
+
+    while (running) {
+        std::this_thread::sleep_for(std::chrono::seconds(STATS_INTERVAL));
+        print_stats(workers);
+    }
+
+    // Clean up
+    for (auto& worker : workers) {
+        worker->timeout_cv.notify_all();
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (auto& worker : workers) {
+        close(worker->sock_fd);
+    }
+    return 0;
+}
+
+/// @brief Create a UDP socket bound to SERVER_PORT that shares the port with other workers
+int create_worker_socket() {
+    struct sockaddr_in server_addr;
 
     // Create UDP socket
     int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
     if(sock_fd < 0) {// Error creating socket
         std::cout << "Error initializing socket\n";
-        return 404;
+        return -1;
+    }
+
+    // Let the kernel spread clients over every socket bound to this port
+    int reuse = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        std::cout << "Error setting SO_REUSEPORT\n";
+        close(sock_fd);
+        return -1;
     }
 
     // Configure server IP/port
@@ -101,103 +455,513 @@ int main() {
     if (bind(sock_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         std::cout << "Error binding socket\n";
         close(sock_fd);
-        return 404;
+        return -1;
     }
+    return sock_fd;
+}
 
-    std::cout << "UDP Server is running on port: " << SERVER_PORT << "...\n";
-
-    // Start timeout thread
-    std::thread timeout_thread(timeout_checker_thread, sock_fd);
+/// @brief Return true if the kernel accepts UDP_SEGMENT (GSO) on this socket
+bool gso_supported(int sock_fd) {
+    int segment_size = CHUNK_SIZE;
+    if (setsockopt(sock_fd, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) < 0) {
+        return false;
+    }
+    // Segment size is given per message, not for the whole socket
+    segment_size = 0;
+    setsockopt(sock_fd, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size));
+    return true;
+}
 
-    while(true) {
-        // Load from socket...
-        int recv_len = recvfrom(sock_fd, buffer, BUFFER_SIZE - 1, 0,
-                                    (struct sockaddr*)&client_addr, &client_len);
+/// @brief Receive loop of one worker
+void worker_thread(Worker& worker) {
+    auto recv_batch = std::make_unique<RecvBatch>();
 
-        // Any incoming data, solve it
-        if(recv_len > 0) {
-            buffer[recv_len] = '\0'; // Add to make sure the data has ending point
+    while(running) {
+        // Load as many datagrams as available from socket (block only for the first one)
+        for (int i = 0; i < RECV_BATCH; i++) {
+            recv_batch->iovecs[i].iov_base = recv_batch->buffers[i];
+            recv_batch->iovecs[i].iov_len = BUFFER_SIZE;
+            memset(&recv_batch->msgs[i].msg_hdr, 0, sizeof(msghdr));
+            recv_batch->msgs[i].msg_hdr.msg_name = &recv_batch->addrs[i];
+            recv_batch->msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            recv_batch->msgs[i].msg_hdr.msg_iov = &recv_batch->iovecs[i];
+            recv_batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int recv_count = recvmmsg(worker.sock_fd, recv_batch->msgs, RECV_BATCH, MSG_WAITFORONE, nullptr);
 
-            // Debug
-            // std::cout << "\n>>> Received from [" << inet_ntoa(client_addr.sin_addr) << ":"
-            //           << ntohs(client_addr.sin_port) << "]: " << buffer << "\n";
+        for (int i = 0; i < recv_count; i++) {
+            char* buffer = recv_batch->buffers[i];
+            int recv_len = recv_batch->msgs[i].msg_len;
+            struct sockaddr_in& client_addr = recv_batch->addrs[i];
+            socklen_t client_len = recv_batch->msgs[i].msg_hdr.msg_namelen;
 
-            // Handle all replies (Commonly ACK replies)
-            if (strncmp(buffer, REPLY, strlen(REPLY)) == 0) {
-                handle_reply_from_client(sock_fd, client_addr, client_len, buffer, recv_len);
+            // Any incoming data, solve it
+            if(recv_len <= 0) {
+                continue;
             }
+            worker.stats.received++;
 
-            // Handle metadata requests (REQUEST_METADATA:filename)
-            else if (strncmp(buffer, REQUEST_METADATA, strlen(REQUEST_METADATA)) == 0) {
-                handle_metadata_request(sock_fd, client_addr, client_len, buffer);
+            // Drop datagrams with wrong version, length or checksum
+            PacketHeader header;
+            if (!parse_packet(buffer, recv_len, header)) {
+                continue;
             }
+            char* payload = buffer + sizeof(PacketHeader);
 
-            // Handle chunk requests (REQUEST_CHUNK:filename:chunk_number)
-            else if (strncmp(buffer, REQUEST_CHUNK, strlen(REQUEST_CHUNK)) == 0) {
-                handle_chunk_request(sock_fd, client_addr, client_len, buffer);
+            // Debug
+            // std::cout << "\n>>> Received from [" << inet_ntoa(client_addr.sin_addr) << ":"
+            //           << ntohs(client_addr.sin_port) << "]: opcode " << (int)header.opcode << "\n";
+
+            switch (header.opcode) {
+                // Handle ACK replies (cumulative seq + SACK bitmap)
+                case OP_ACK:
+                    handle_reply_from_client(worker, client_addr, client_len, header, payload);
+                    break;
+
+                // Handle metadata requests (payload = filename)
+                case OP_REQUEST_METADATA:
+                    handle_metadata_request(worker, client_addr, client_len, header, payload);
+                    break;
+
+                // Handle chunk requests (file handle + chunk id)
+                case OP_REQUEST_CHUNK:
+                    handle_chunk_request(worker, client_addr, client_len, header);
+                    break;
+
+                // Handle batch chunk requests (file handle + first chunk id + pacing rate + bitmap)
+                case OP_REQUEST_CHUNKS:
+                    handle_chunks_request(worker, client_addr, client_len, header, payload);
+                    break;
+
+                // Handle hash requests (file handle + first leaf)
+                case OP_REQUEST_HASHES:
+                    handle_hashes_request(worker, client_addr, client_len, header);
+                    break;
+
+                // Handle catalog requests (page + chunk size)
+                case OP_REQUEST_CATALOG:
+                    handle_catalog_request(worker, client_addr, client_len, header, payload);
+                    break;
+
+                default:
+                    handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
             }
-            else {
-                handle_reply_to_client(sock_fd, client_addr, client_len, BAD_REQUEST, strlen(BAD_REQUEST));
+        }
+
+        // Send all replies of this round at once
+        batch_flush(worker.sock_fd, *worker.send_batch);
+    }
+}
+
+/// @brief Print per-worker counters
+void print_stats(std::vector<std::unique_ptr<Worker>>& workers) {
+    size_t num_sessions = 0, in_flight = 0;
+    for (SessionStripe& stripe : session_stripes) {
+        std::lock_guard<std::mutex> lock(stripe.mtx);
+        num_sessions += stripe.sessions.size();
+        for (auto& [key, session] : stripe.sessions) {
+            in_flight += session.pending_packets.size();
+        }
+    }
+
+    std::cout << "\n--- Worker stats ---\n";
+    for (auto& worker : workers) {
+        std::cout << "Worker " << worker->id
+                  << ": recv " << worker->stats.received
+                  << ", sent " << worker->stats.sent
+                  << ", acked " << worker->stats.acked
+                  << ", resent " << worker->stats.retransmitted
+                  << ", fast resent " << worker->stats.fast_retransmitted
+                  << ", paced " << worker->stats.paced
+                  << ", shed " << worker->stats.shed
+                  << ", parity " << worker->stats.parity
+                  << ", compressed " << worker->stats.compressed << " (-" << worker->stats.compress_saved / 1024 << " KiB)"
+                  << ", dropped " << worker->stats.dropped << "\n";
+    }
+    std::cout << "Sessions: " << num_sessions << ", in-flight: " << in_flight << "\n"
+              << "--------------------\n";
+}
+
+/// @brief Queue a datagram to be sent, flush the batch first if it is full
+void batch_push(int sock_fd, SendBatch& batch, const sockaddr_in& addr, const char* data, size_t len) {
+    if (batch.data_len + len > SEND_BATCH_BYTES) {
+        batch_flush(sock_fd, batch);
+    }
+
+    // Merge into the previous message if it goes to the same client (GSO segment)
+    if (batch.gso && batch.count > 0) {
+        unsigned int i = batch.count - 1;
+        if (!batch.closed[i] && len <= batch.segment_size[i] && batch.segments[i] < GSO_MAX_SEGMENTS
+            && batch.iovecs[i].iov_len + len <= GSO_MAX_BYTES
+            && batch.addrs[i].sin_addr.s_addr == addr.sin_addr.s_addr && batch.addrs[i].sin_port == addr.sin_port) {
+            memcpy(batch.data + batch.data_len, data, len);
+            batch.data_len += len;
+            batch.iovecs[i].iov_len += len;
+            batch.segments[i]++;
+            batch.closed[i] = len < batch.segment_size[i];
+            return;
+        }
+    }
+
+    if (batch.count == SEND_BATCH) {
+        batch_flush(sock_fd, batch);
+    }
+
+    unsigned int i = batch.count++;
+    memcpy(batch.data + batch.data_len, data, len);
+    batch.addrs[i] = addr;
+    batch.iovecs[i].iov_base = batch.data + batch.data_len;
+    batch.iovecs[i].iov_len = len;
+    batch.segment_size[i] = len;
+    batch.segments[i] = 1;
+    batch.closed[i] = false;
+    batch.data_len += len;
+    memset(&batch.msgs[i].msg_hdr, 0, sizeof(msghdr));
+    batch.msgs[i].msg_hdr.msg_name = &batch.addrs[i];
+    batch.msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    batch.msgs[i].msg_hdr.msg_iov = &batch.iovecs[i];
+    batch.msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+/// @brief Send every queued datagram with sendmmsg
+void batch_flush(int sock_fd, SendBatch& batch) {
+    // Tell the kernel how to split merged messages
+    for (unsigned int i = 0; i < batch.count; i++) {
+        if (batch.segments[i] > 1) {
+            msghdr& msg = batch.msgs[i].msg_hdr;
+            msg.msg_control = batch.controls[i];
+            msg.msg_controllen = sizeof(batch.controls[i]);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cmsg), &batch.segment_size[i], sizeof(uint16_t));
+        }
+    }
+
+    unsigned int sent = 0;
+    while (sent < batch.count) {
+        int ret = sendmmsg(sock_fd, batch.msgs + sent, batch.count - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            // Device can not segment (EIO) or segment is larger than the route MTU (EINVAL):
+            // stop merging and skip this message, the timeout thread resends its datagrams one by one
+            if (batch.segments[sent] > 1 && (errno == EIO || errno == EINVAL)) {
+                batch.gso = false;
+                sent++;
+                continue;
             }
+            break;
         }
-        timeout_cv.notify_one();
+        sent += ret;
     }
+    batch.count = 0;
+    batch.data_len = 0;
+}
 
-    // Clean up
-    running = false;
-    timeout_cv.notify_all();
-    timeout_thread.join();
-    close(sock_fd);
-    return 0;
+/// @brief Stat one entry of DOWNLOAD_DIR into catalog_index, return true if the index changed
+bool catalog_refresh(const std::string& name) {
+    char fullpath[MAX_FILE_LENGTH * 2];
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", DOWNLOAD_DIR, name.c_str());
+
+    struct stat file_stat;
+    auto it = catalog_index.find(name);
+    if (stat(fullpath, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+        if (it == catalog_index.end()) {
+            return false;
+        }
+        catalog_index.erase(it);        // Removed, renamed away or no longer a regular file
+    }
+    else {
+        if (it != catalog_index.end() && it->second.size == (size_t)file_stat.st_size
+            && it->second.mtime.tv_sec == file_stat.st_mtim.tv_sec && it->second.mtime.tv_nsec == file_stat.st_mtim.tv_nsec) {
+            return false;
+        }
+        catalog_index[name] = CatalogFile{name, (size_t)file_stat.st_size, file_stat.st_mtim, {}};
+    }
+    file_cache_invalidate(fullpath);
+    return true;
 }
-/// @brief Update list of files to download
-void update_list() {
-    std::cout << "Database is old. Reloading...\n";
+
+/// @brief Rebuild catalog_index from a full scan of DOWNLOAD_DIR, return true if the index changed
+bool catalog_scan() {
     DIR *dir = opendir(DOWNLOAD_DIR);
 
     // Unable to open this path
     if (dir == 0) {
         std::cout << "Error opening path: " << DOWNLOAD_DIR << "\n";
-        return;
+        return false;
     }
 
+    // Names seen now or before, each one checked like an event for it
+    std::vector<std::string> names;
     struct dirent *entry;
-    struct stat file_stat;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    for (auto& indexed : catalog_index) {
+        names.push_back(indexed.first);
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
 
-    // Write to file
-    FILE* file = fopen(DOWNLOAD_LIST, "w");
-    if (file == NULL) {
-        std::cout << "Error: Unable to create/open file " << DOWNLOAD_LIST << "\n";
-        exit(0);
+    bool changed = false;
+    for (const std::string& name : names) {
+        changed |= catalog_refresh(name);
     }
+    return changed;
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+/// @brief Build the hash trees catalog_index misses for catalog_chunk_sizes (HASH_THREADS threads each), drop the
+/// ones of chunk sizes no longer kept. A file that no longer matches its entry is skipped: the event of its change
+/// refreshes it. Return true if the index changed
+bool catalog_hash() {
+    std::vector<uint32_t> chunk_sizes;
+    {
+        std::lock_guard<std::mutex> lock(catalog_mtx);
+        chunk_sizes = catalog_chunk_sizes;
+    }
+
+    // New chunk sizes are published even without files: DOWNLOAD_LIST is hashed for them then
+    bool changed = chunk_sizes != catalog_hashed_sizes;
+    catalog_hashed_sizes = chunk_sizes;
+    for (auto& [name, indexed] : catalog_index) {
+        for (auto it = indexed.trees.begin(); it != indexed.trees.end(); ) {
+            if (std::find(chunk_sizes.begin(), chunk_sizes.end(), it->first) == chunk_sizes.end()) {
+                it = indexed.trees.erase(it);
+                changed = true;
+            } else {
+                it++;
+            }
+        }
+        if (indexed.trees.size() == chunk_sizes.size() || !running) {
             continue;
+        }
 
-        char full_path[1024];
-        snprintf(full_path, sizeof(full_path), "%s/%s", DOWNLOAD_DIR, entry->d_name);
+        char fullpath[MAX_FILE_LENGTH * 2];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", DOWNLOAD_DIR, name.c_str());
+        changed |= catalog_hash_file(fullpath, indexed, chunk_sizes);
+    }
+    return changed;
+}
 
-        if (stat(full_path, &file_stat) == -1) {
-            fprintf(stderr, "Error reading %s: %s\n", entry->d_name, strerror(errno));
+/// @brief Build the hash trees a file misses for chunk_sizes (HASH_THREADS threads each). Nothing is built if the
+/// file no longer matches indexed. Return true if it got any
+bool catalog_hash_file(const char* fullpath, CatalogFile& indexed, const std::vector<uint32_t>& chunk_sizes) {
+    int fd = open(fullpath, O_RDONLY);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size != indexed.size
+        || file_stat.st_mtim.tv_sec != indexed.mtime.tv_sec || file_stat.st_mtim.tv_nsec != indexed.mtime.tv_nsec) {
+        if (fd != -1) close(fd);
+        return false;
+    }
+    bool changed = false;
+    for (uint32_t chunk_size : chunk_sizes) {
+        if (indexed.trees.count(chunk_size) != 0) {
             continue;
         }
+        auto tree = std::make_shared<HashTree>();
+        if (!merkle_leaves(fd, indexed.size, chunk_size, tree->leaves, HASH_THREADS)) {
+            break;      // Truncated meanwhile
+        }
+        tree->root = merkle_root(tree->leaves);
+        tree->size = indexed.size;
+        tree->mtime = indexed.mtime;
+        indexed.trees[chunk_size] = tree;
+        changed = true;
+    }
+    close(fd);
+    return changed;
+}
 
-        fprintf(file, "%s %ld\n", entry->d_name, file_stat.st_size);        // Write to file
+/// @brief Hash tree the latest catalog has for a file version (name in DOWNLOAD_DIR, or DOWNLOAD_LIST), nullptr if
+/// that version or chunk size is not hashed (yet)
+std::shared_ptr<const HashTree> catalog_tree(const std::string& name, uint32_t chunk_size, size_t size, const struct timespec& mtime) {
+    std::shared_ptr<CatalogSnapshot> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(catalog_mtx);
+        snapshot = catalog;
     }
-    fclose(file);
-    closedir(dir);
+    const CatalogFile* indexed = &snapshot->list;
+    if (name != DOWNLOAD_LIST) {
+        auto it = std::lower_bound(snapshot->files.begin(), snapshot->files.end(), name,
+                                   [](const CatalogFile& file, const std::string& key) { return file.name < key; });
+        if (it == snapshot->files.end() || it->name != name) {
+            return nullptr;
+        }
+        indexed = &*it;
+    }
+    auto tree = indexed->trees.find(chunk_size);
+    if (tree == indexed->trees.end() || tree->second->size != size
+        || tree->second->mtime.tv_sec != mtime.tv_sec || tree->second->mtime.tv_nsec != mtime.tv_nsec) {
+        return nullptr;
+    }
+    return tree->second;
 }
 
-/// @brief Return true if we need to refresh list
-bool isTimeout() {
-    time_t current_time = time(NULL); // Get current time
+/// @brief Ask the catalog thread to hash the catalog for chunk_size too (the oldest of CATALOG_CHUNK_SIZES is dropped)
+void catalog_want_chunk_size(uint32_t chunk_size) {
+    {
+        std::lock_guard<std::mutex> lock(catalog_mtx);
+        if (std::find(catalog_chunk_sizes.begin(), catalog_chunk_sizes.end(), chunk_size) != catalog_chunk_sizes.end()) {
+            return;
+        }
+        if (catalog_chunk_sizes.size() >= CATALOG_CHUNK_SIZES) {
+            catalog_chunk_sizes.erase(catalog_chunk_sizes.begin());
+        }
+        catalog_chunk_sizes.push_back(chunk_size);
+    }
+    uint64_t one = 1;
+    if (write(catalog_wake_fd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Error waking the catalog thread: %s\n", strerror(errno));
+    }
+}
 
-    if (difftime(current_time, last_reload) >= RELOAD_INTERVAL) {
-        last_reload = current_time;
-        return true;
+/// @brief Publish catalog_index as a new catalog generation and rewrite DOWNLOAD_LIST from it
+void catalog_publish() {
+    auto snapshot = std::make_shared<CatalogSnapshot>();
+    snapshot->files.reserve(catalog_index.size());
+    for (auto& indexed : catalog_index) {
+        snapshot->files.push_back(indexed.second);
+    }
+
+    // Plain list for OP_REQUEST_METADATA DOWNLOAD_LIST: written to a temporary file then renamed,
+    // so open copies of the old list stay valid. Hashed like the files before it is published
+    char tmp_path[MAX_FILE_LENGTH];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", DOWNLOAD_LIST);
+    FILE* file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error creating %s: %s\n", tmp_path, strerror(errno));
+    } else {
+        for (const CatalogFile& indexed : snapshot->files) {
+            fprintf(file, "%s %zu\n", indexed.name.c_str(), indexed.size);
+        }
+        fclose(file);
+        struct stat file_stat;
+        if (rename(tmp_path, DOWNLOAD_LIST) == -1) {
+            fprintf(stderr, "Error replacing %s: %s\n", DOWNLOAD_LIST, strerror(errno));
+        } else if (stat(DOWNLOAD_LIST, &file_stat) == 0) {
+            std::vector<uint32_t> chunk_sizes;
+            {
+                std::lock_guard<std::mutex> lock(catalog_mtx);
+                chunk_sizes = catalog_chunk_sizes;
+            }
+            snapshot->list = CatalogFile{DOWNLOAD_LIST, (size_t)file_stat.st_size, file_stat.st_mtim, {}};
+            catalog_hash_file(DOWNLOAD_LIST, snapshot->list, chunk_sizes);
+        }
     }
-    return false;
+
+    {
+        std::lock_guard<std::mutex> lock(catalog_mtx);
+        snapshot->generation = (catalog != nullptr ? catalog->generation : 0) + 1;
+        catalog = snapshot;
+    }
+    std::cout << "Catalog: " << snapshot->files.size() << " file(s), generation " << snapshot->generation << "\n";
+    file_cache_invalidate(DOWNLOAD_LIST);
+}
+
+/** CATALOG THREAD **/
+void catalog_watch_thread() {
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1 || inotify_add_watch(inotify_fd, DOWNLOAD_DIR, IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+                                              | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB) == -1) {
+        fprintf(stderr, "No inotify on %s (%s), rescanning every %d s\n", DOWNLOAD_DIR, strerror(errno), CATALOG_RESCAN_INTERVAL);
+        if (inotify_fd != -1) {
+            close(inotify_fd);
+        }
+        auto rescan_at = std::chrono::steady_clock::now() + std::chrono::seconds(CATALOG_RESCAN_INTERVAL);
+        while (running) {
+            // Woken early for a new chunk size to hash
+            int wait_ms = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                   rescan_at - std::chrono::steady_clock::now()).count());
+            struct pollfd pfd = {catalog_wake_fd, POLLIN, 0};
+            if (poll(&pfd, 1, std::min(wait_ms, 1000)) > 0) {
+                uint64_t count;
+                while (read(catalog_wake_fd, &count, sizeof(count)) > 0) {}
+            }
+            bool changed = false;
+            if (std::chrono::steady_clock::now() >= rescan_at) {
+                changed = catalog_scan();
+                rescan_at = std::chrono::steady_clock::now() + std::chrono::seconds(CATALOG_RESCAN_INTERVAL);
+            }
+            if (catalog_hash() || changed) {
+                catalog_publish();
+            }
+        }
+        return;
+    }
+
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    bool changed = false;
+    auto publish_at = std::chrono::steady_clock::now();
+    while (running) {
+        // Changes are published at most CATALOG_DEBOUNCE_MS after the first one, a burst makes one generation
+        int wait_ms = 1000;
+        if (changed) {
+            wait_ms = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                               publish_at - std::chrono::steady_clock::now()).count());
+        }
+        struct pollfd pfds[2] = {{inotify_fd, POLLIN, 0}, {catalog_wake_fd, POLLIN, 0}};
+        if (poll(pfds, 2, wait_ms) > 0) {
+            // A catalog request asked for a new chunk size: hashed now, unless a generation is due soon anyway
+            if (pfds[1].revents & POLLIN) {
+                uint64_t count;
+                while (read(catalog_wake_fd, &count, sizeof(count)) > 0) {}
+                if (!changed && catalog_hash()) {
+                    catalog_publish();
+                }
+            }
+            bool was_changed = changed;
+            ssize_t len;
+            while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+                for (char* p = buffer; p < buffer + len; ) {
+                    struct inotify_event* event = (struct inotify_event*)p;
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        changed |= catalog_scan();          // Events were lost
+                    }
+                    else if (event->len > 0) {
+                        changed |= catalog_refresh(event->name);
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            if (changed && !was_changed) {
+                publish_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(CATALOG_DEBOUNCE_MS);
+            }
+        }
+        if (changed && std::chrono::steady_clock::now() >= publish_at) {
+            catalog_hash();             // Hash trees of the changed files, before requests can see them
+            catalog_publish();
+            changed = false;
+        }
+    }
+    close(inotify_fd);
+}
+
+/// @brief First file of each page of a catalog for chunk_size, computed once per snapshot
+const std::vector<size_t>& catalog_pages(CatalogSnapshot& snapshot, uint32_t chunk_size) {
+    std::lock_guard<std::mutex> lock(snapshot.pages_mtx);
+    auto it = snapshot.page_starts.find(chunk_size);
+    if (it != snapshot.page_starts.end()) {
+        return it->second;
+    }
+
+    // Page boundaries only depend on the names
+    std::vector<size_t>& page_starts = snapshot.page_starts[chunk_size];
+    page_starts.push_back(0);
+    size_t page_len = sizeof(CatalogPage);
+    for (size_t i = 0; i < snapshot.files.size(); i++) {
+        size_t entry_len = sizeof(CatalogEntry) + snapshot.files[i].name.size();
+        if (page_len + entry_len > chunk_size && page_len > sizeof(CatalogPage)) {
+            page_starts.push_back(i);
+            page_len = sizeof(CatalogPage);
+        }
+        page_len += entry_len;
+    }
+    return page_starts;
 }
 
 /// @brief Convert from host order (Little endian/Big endian) to network order (Big endian)
@@ -205,296 +969,1035 @@ uint64_t htonll(uint64_t value) {
     return (((uint64_t)htonl(value & 0xFFFFFFFF)) << 32 | htonl(value >> 32));
 }
 
-void handle_fullname_getter(char* fullpath, char* &filename) {
-    // Special request: List file
-    if (strncmp(filename, DOWNLOAD_LIST, strlen(DOWNLOAD_LIST)) == 0) {
-        // If data is old, update it first
-        if (isTimeout()) {
-            update_list();
+/// @brief Convert from network order (Big endian) to host order (Little endian/Big endian)
+uint64_t ntohll(uint64_t value) {
+    return (((uint64_t)ntohl(value & 0xFFFFFFFF)) << 32 | ntohl(value >> 32));
+}
+
+/// @brief Get the handle of a file served with chunk_size and codec, a new one is given the first time they are seen
+uint32_t file_handle_get(const char* fullpath, uint32_t chunk_size, uint16_t codec) {
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    auto key = std::make_tuple(std::string(fullpath), chunk_size, codec);
+    auto it = handle_by_path.find(key);
+    if (it != handle_by_path.end()) {
+        return it->second;
+    }
+
+    file_handles.push_back(FileHandle{fullpath, chunk_size, codec});
+    uint32_t file_handle = file_handles.size();      // Handle 0 is never given
+    handle_by_path[key] = file_handle;
+    return file_handle;
+}
+
+/// @brief Get an open file from open-file table, (re)open it if missing or changed on disk
+std::shared_ptr<OpenFile> file_cache_get(uint32_t file_handle, bool force_check) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(cache_mtx);
+
+    // Unknown handle
+    if (file_handle == 0 || file_handle > file_handles.size()) {
+        return nullptr;
+    }
+    const char* fullpath = file_handles[file_handle - 1].fullpath.c_str();
+
+    auto it = file_cache.find(file_handle);
+    if (it != file_cache.end()) {
+        CachedFile& cached = it->second;
+        bool valid = true;
+
+        // Only stat the file once in a while, not on every chunk
+        if (force_check || now - cached.last_check > std::chrono::milliseconds(CACHE_REVALIDATE_MS)) {
+            struct stat file_stat;
+            valid = stat(fullpath, &file_stat) == 0
+                    && (size_t)file_stat.st_size == cached.file->size
+                    && file_stat.st_mtim.tv_sec == cached.file->mtime.tv_sec
+                    && file_stat.st_mtim.tv_nsec == cached.file->mtime.tv_nsec;
+            cached.last_check = now;
+        }
+
+        if (valid) {
+            file_lru.splice(file_lru.begin(), file_lru, cached.lru_it);     // Move to front
+            return cached.file;
+        }
+
+        // File has been changed or removed, drop the old descriptor
+        file_lru.erase(cached.lru_it);
+        file_cache.erase(it);
+    }
+
+    // Open file
+    auto file = std::make_shared<OpenFile>();
+    struct stat file_stat;
+    file->fd = open(fullpath, O_RDONLY);
+    if (file->fd == -1 || fstat(file->fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        return nullptr;
+    }
+    file->size = file_stat.st_size;
+    file->mtime = file_stat.st_mtim;
+    file->chunk_size = file_handles[file_handle - 1].chunk_size;
+    file->codec = file_handles[file_handle - 1].codec;
+
+    // Evict least recently used file if table is full
+    if (file_cache.size() >= MAX_OPEN_FILES) {
+        file_cache.erase(file_lru.back());
+        file_lru.pop_back();
+    }
+
+    file_lru.push_front(file_handle);
+    file_cache[file_handle] = CachedFile{file, now, file_lru.begin()};
+    return file;
+}
+
+/// @brief Drop a file from open-file table (closed when the last user is done)
+void file_cache_invalidate(const char* fullpath) {
+    std::lock_guard<std::mutex> lock(cache_mtx);
+
+    // Every chunk size and codec the file is served with
+    for (auto handle_it = handle_by_path.lower_bound(std::make_tuple(std::string(fullpath), 0u, (uint16_t)0));
+         handle_it != handle_by_path.end() && std::get<0>(handle_it->first) == fullpath; handle_it++) {
+        auto it = file_cache.find(handle_it->second);
+        if (it != file_cache.end()) {
+            file_lru.erase(it->second.lru_it);
+            file_cache.erase(it);
+        }
+    }
+}
+
+/// @brief Read chunk_index of a file into buffer (len = its size, from the size the file was opened with).
+/// Return false if the file ended first: it was truncated while served
+bool file_read_chunk(const OpenFile& file, uint64_t chunk_index, char* buffer, size_t& len) {
+    size_t offset = chunk_index * file.chunk_size;
+    len = std::min<uint64_t>(file.chunk_size, file.size - offset);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = pread(file.fd, buffer + done, len - done, offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        done += ret;
+    }
+    return true;
+}
+
+/// @brief Forget a file handle whose file no longer matches what was opened (shrunk while served): the next
+/// request reopens it and sees the new size, as the catalog thread will once the writer closes it
+void file_changed(uint32_t file_handle) {
+    std::string fullpath;
+    {
+        std::lock_guard<std::mutex> lock(cache_mtx);
+        fullpath = file_handles[file_handle - 1].fullpath;
+    }
+    file_cache_invalidate(fullpath.c_str());
+}
+
+OpenFile::~OpenFile() {
+    if (fd != -1) close(fd);
+    compressed_cache_bytes -= compressed_bytes;
+}
+
+/// @brief Chunk size a requested one is served with (0 = CHUNK_SIZE): the largest allowed size not above it, among
+/// powers of two from MIN_CHUNK_SIZE, the largest payloads of CHUNK_SIZE_MTUS and MAX_CHUNK_SIZE. Handles and
+/// hash trees exist per chunk size, so clients can not make the server keep one per byte value
+uint32_t chunk_size_allowed(uint32_t requested) {
+    if (requested == 0) {
+        requested = CHUNK_SIZE;
+    }
+    uint32_t allowed = MIN_CHUNK_SIZE;
+    for (uint32_t size = MIN_CHUNK_SIZE; size <= MAX_CHUNK_SIZE; size *= 2) {
+        if (size <= requested) {
+            allowed = size;
+        }
+    }
+    for (int mtu : CHUNK_SIZE_MTUS) {
+        uint32_t size = mtu - 20 - 8 - sizeof(PacketHeader);     // IPv4 + UDP + our header
+        if (size <= requested && size > allowed) {
+            allowed = size;
+        }
+    }
+    return requested >= MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : allowed;
+}
+
+/// @brief Codec to serve a file with among the ones a client accepts, 0 for content that is compressed already
+/// (INCOMPRESSIBLE_EXTENSIONS): compressing it again only costs time
+uint16_t compress_codec(const char* filename, uint16_t accepted) {
+    if (!(accepted & COMPRESS_LZ4)) {
+        return 0;
+    }
+    const char* dot = strrchr(filename, '.');
+    if (dot == nullptr) {
+        return COMPRESS_LZ4;
+    }
+    std::string extension = " ";
+    for (const char* c = dot; *c != '\0'; c++) {
+        extension += tolower((unsigned char)*c);
+    }
+    extension += " ";
+    return strstr(" " INCOMPRESSIBLE_EXTENSIONS " ", extension.c_str()) != nullptr ? 0 : COMPRESS_LZ4;
+}
+
+/// @brief Compressed data of a chunk with the codec of its file (len = its size, set to the compressed size):
+/// from the cache, or compressed now and kept while COMPRESS_CACHE_BYTES allows. nullptr if the chunk is sent
+/// raw: no codec, less than COMPRESS_MAX_RATIO gained, or none of the first COMPRESS_PROBE_CHUNKS chunks of
+/// the file gained anything
+const char* chunk_compressed(Worker& worker, OpenFile& file, uint64_t chunk_index, const char* data, size_t& len) {
+    if (file.codec == 0) {
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(file.compressed_mtx);
+        if (file.compressed.empty()) {
+            uint64_t num_chunks = (file.size + file.chunk_size - 1) / file.chunk_size;
+            file.compressed.resize(num_chunks);
+            file.raw_chunks.resize(num_chunks);
+        }
+        const std::vector<char>& cached = file.compressed[chunk_index];
+        if (!cached.empty()) {
+            len = cached.size();
+            return cached.data();
+        }
+        if (file.raw_chunks[chunk_index] || (file.probed >= COMPRESS_PROBE_CHUNKS && file.gained == 0)) {
+            return nullptr;
         }
+    }
+
+    // Compressed without the lock: a cap below the chunk size stops as soon as it is not worth it
+    std::vector<char>& out = worker.compressed;
+    if (out.size() < lz4_bound(len)) {
+        out.resize(lz4_bound(len));
+    }
+    size_t out_len = lz4_compress(data, len, out.data(), (size_t)(len * COMPRESS_MAX_RATIO));
+
+    std::lock_guard<std::mutex> lock(file.compressed_mtx);
+    file.probed++;
+    if (out_len == 0) {
+        file.raw_chunks[chunk_index] = true;
+        return nullptr;
+    }
+    file.gained++;
+    len = out_len;
+    std::vector<char>& cached = file.compressed[chunk_index];
+    if (!cached.empty() || compressed_cache_bytes + out_len > COMPRESS_CACHE_BYTES) {
+        return out.data();      // Another worker cached it meanwhile, or no room left
+    }
+    cached.assign(out.data(), out.data() + out_len);
+    file.compressed_bytes += out_len;
+    compressed_cache_bytes += out_len;
+    return cached.data();
+}
+
+bool handle_fullname_getter(char* fullpath, char* &filename) {
+    // Special request: List file (kept up to date by the catalog thread)
+    if (strcmp(filename, DOWNLOAD_LIST) == 0) {
         // Special file then get that file in the main directory
         strcpy(fullpath, filename);
+        return true;
     }
-    // Normal file then go to specific download directory to get file
-    else {
-        sprintf(fullpath, "%s/%s", DOWNLOAD_DIR, filename);
+
+    // Only plain entries of DOWNLOAD_DIR: no subdirectory, no parent
+    if (strchr(filename, '/') != NULL || strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
+        return false;
     }
+    // Normal file then go to specific download directory to get file
+    sprintf(fullpath, "%s/%s", DOWNLOAD_DIR, filename);
+    return true;
 }
 
-/// @brief Handle metadata requests (REQUEST_METADATA:filename)
-void handle_metadata_request(int server_sock, struct sockaddr_in &client_addr, socklen_t &client_len, char* buffer) {
-    std::cout << "[SERVER] Entering handle_metadata_request\n";
+/// @brief Handle metadata requests (OP_REQUEST_METADATA, payload = requested chunk size + filename)
+void handle_metadata_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header, char* payload) {
     char fullpath[MAX_FILE_LENGTH * 2];
-    char* token = strtok(buffer, ":"); // Initialize token splitter
-
-    // Get filename
-    token = strtok(NULL, ":");
+    char filename[MAX_FILE_LENGTH];
+    uint32_t chunk_size;
+    size_t name_len = header.length - sizeof(chunk_size);
 
-    // No name detected (wrong structure)
-    if (token == NULL) {
-        handle_reply_to_client(server_sock, client_addr, client_len, BAD_REQUEST, strlen(BAD_REQUEST));
+    // No name detected or name too long (wrong structure)
+    if (header.length <= sizeof(chunk_size) || name_len >= MAX_FILE_LENGTH
+        || memchr(payload + sizeof(chunk_size), '\0', name_len) != NULL) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
         return;
     }
+    memcpy(&chunk_size, payload, sizeof(chunk_size));
+    memcpy(filename, payload + sizeof(chunk_size), name_len);
+    filename[name_len] = '\0';
 
-    char* filename = token;
+    // Requested chunk size, 0 = server default
+    chunk_size = chunk_size_allowed(ntohl(chunk_size));
 
-    handle_fullname_getter(fullpath, filename);
+    char* name = filename;
+    if (!handle_fullname_getter(fullpath, name)) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
+        return;
+    }
+
+    // Handles are only given for files that exist
+    struct stat file_stat;
+    if (stat(fullpath, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
+        return;
+    }
 
-    struct stat file_stat; // Get file information (eg. file size...)
     Metadata meta = {0};
-    int fd = open(fullpath, O_RDONLY);
+    uint16_t codec = compress_codec(filename, header.flags);
+    uint32_t file_handle = file_handle_get(fullpath, chunk_size, codec);
+    std::shared_ptr<OpenFile> file = file_cache_get(file_handle, true);    // Metadata always sees the latest file
 
-    // If file is exists then calculate
-    if (fd != -1 && fstat(fd, &file_stat) == 0) {
-        meta.file_size = file_stat.st_size;
-        meta.chunk_size = CHUNK_SIZE;    // Lấy chunk size mặc định
-        meta.num_chunk = (file_stat.st_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
-        close(fd);
-    }
     // If unable to open file
-    else {
-        handle_reply_to_client(server_sock, client_addr, client_len, BAD_REQUEST, strlen(BAD_REQUEST));
+    if (file == nullptr) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
         return;
     }
 
-    //Debug
-    std::cout << "\n--- Metadata ---\n"
-              << "File: " << filename << "\n"
-              << "Size: " << meta.file_size << " bytes\n"
-              << "Chunk count: " << meta.num_chunk << "\n"
-              << "Chunk size: " << meta.chunk_size << " bytes\n"
-              << "----------------\n";
+    // Root hash from the catalog thread: until it has hashed this version, the client is told to ask again
+    char message[sizeof(Metadata) + MAX_FILE_LENGTH];
+    std::shared_ptr<const HashTree> tree = file_hash_tree(file_handle, *file);
+    if (tree == nullptr) {
+        memset(message, 0, sizeof(Metadata));
+        memcpy(message + sizeof(Metadata), filename, name_len);
+        handle_unsequenced_reply(worker, client_addr, OP_META, file_handle, message, sizeof(Metadata) + name_len,
+                                 META_PENDING);
+        return;
+    }
+    meta.file_size = file->size;
+    meta.chunk_size = chunk_size;
+    meta.num_chunk = (file->size + chunk_size - 1) / chunk_size;
 
     // Make a metadata copy with network order (big endian)
     Metadata net_meta;
     net_meta.file_size = htonll(meta.file_size);      // Hàm tự định nghĩa cho 64-bit
     net_meta.num_chunk = htonll(meta.num_chunk);
     net_meta.chunk_size = htonll(meta.chunk_size);
+    memcpy(net_meta.root_hash, tree->root.data(), SHA256_SIZE);
+
+    // Make a reply payload: Metadata + filename (to let client match its request)
+    memcpy(message, &net_meta, sizeof(net_meta));
+    memcpy(message + sizeof(net_meta), filename, name_len);
+    handle_reply_to_client(worker, client_addr, client_len, OP_META, file_handle, 0,
+                           message, sizeof(net_meta) + name_len, codec);
+}
 
-    // Make a reply message
-    char message[BUFFER_SIZE];
-    snprintf(message, sizeof(message), "META:%s:", filename); // Header
-
-    // Copy data to message
-    size_t header_len = strlen(message);
-    if (header_len + sizeof(net_meta) <= BUFFER_SIZE) {
-        memcpy(message + header_len, &net_meta, sizeof(net_meta));
-        size_t total_len = header_len + sizeof(net_meta);
-        // Chú ý: Hàm handle_reply_to_client đã tự thêm header REPLY và sequence number
-        handle_reply_to_client(server_sock, client_addr, client_len, message, total_len);
-        printf("Debug in meta func: Header: %s, Metadata size: %zu bytes\n", message, sizeof(net_meta));
+/// @brief Handle chunk requests (OP_REQUEST_CHUNK, file handle + chunk id)
+void handle_chunk_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header) {
+    uint64_t chunk_index = header.chunk_id;
+
+    // //Debug
+    // std::cout << "\n--- REQUEST ---\n"
+    //           << "Handle: " << header.file_handle << "\n"
+    //           << "Chunk ID: " << chunk_index << "\n"
+    //           << "----------------\n";
+
+    // Get file from open-file table
+    std::shared_ptr<OpenFile> file = file_cache_get(header.file_handle);
+
+    // Unknown handle or file do not open
+    if (file == nullptr) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
         return;
-    } else {
-        std::cerr << "[SERVER] Metadata phản hồi quá lớn.\n";
-        handle_reply_to_client(server_sock, client_addr, client_len, INTERNAL_ERROR, strlen(INTERNAL_ERROR));
+    }
+
+    uint64_t num_chunks = (file->size + file->chunk_size - 1) / file->chunk_size;
+
+    // If request chunk ID exceeded accepted range
+    if (chunk_index >= num_chunks) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
         return;
     }
+
+    if (!send_chunk(worker, client_addr, client_len, header.file_handle, *file, chunk_index)) {
+        file_changed(header.file_handle);
+    }
 }
 
-/// @brief Handle chunk requests (REQUEST_CHUNK:filename:chunk_number)
-void handle_chunk_request(int server_sock, struct sockaddr_in &client_addr, socklen_t &client_len, char* buffer) {
-    char filename[MAX_FILE_LENGTH];
-    char fullpath[MAX_FILE_LENGTH * 2];
-    char reply_message[BUFFER_SIZE];
-    struct stat file_stat;
-    char* tok = strtok(buffer, ":"); // Initialize token splitter
+/// @brief Handle batch chunk requests (OP_REQUEST_CHUNKS, file handle + first chunk id, payload = pacing rate + bitmap)
+void handle_chunks_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header, char* payload) {
+    uint32_t pacing_rate;
+    size_t bitmap_len = header.length - sizeof(pacing_rate);
 
-    tok = strtok(NULL, ":");      // Filename
-    // Name does not exist
-    if(tok == NULL) {
-        handle_reply_to_client(server_sock, client_addr, client_len, BAD_REQUEST, strlen(BAD_REQUEST));
+    // Bitmap must fit the window
+    if (header.length <= sizeof(pacing_rate) || bitmap_len * 8 > MAX_BATCH_CHUNKS) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
         return;
     }
-    strncpy(filename, tok, sizeof(filename) - 1);
-    handle_fullname_getter(fullpath, tok);
+    memcpy(&pacing_rate, payload, sizeof(pacing_rate));
+    char* bitmap = payload + sizeof(pacing_rate);
 
-    // //Debug
-    // std::cout << "\n--- REQUEST ---\n"
-    //           << "File: " << filename << "\n";
+    // Get file from open-file table (once for the whole batch)
+    std::shared_ptr<OpenFile> file = file_cache_get(header.file_handle);
 
-    tok = strtok(NULL, ":");      // Chunk ID
-    // Chunk ID does not exist
-    if(tok == NULL) {
-        handle_reply_to_client(server_sock, client_addr, client_len, BAD_REQUEST, strlen(BAD_REQUEST));
+    // Unknown handle or file do not open
+    if (file == nullptr) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
         return;
     }
-    uint64_t chunk_index = std::strtoul(tok, nullptr, 10);
-
-    // //Debug
-    // std::cout<< "Chunk ID: " << chunk_index << "\n"
-    //          << "----------------\n";
 
-    // Read file
-    int fd = open(fullpath, O_RDONLY);
+    uint64_t num_chunks = (file->size + file->chunk_size - 1) / file->chunk_size;
 
-    // File do not open
-    if (fd == -1) {
-        handle_reply_to_client(server_sock, client_addr, client_len, BAD_REQUEST, strlen(BAD_REQUEST));
+    // If first chunk ID exceeded accepted range
+    if (header.chunk_id >= num_chunks) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
         return;
     }
 
-    // Unable to read file information
-    if (fstat(fd, &file_stat) != 0) {
-        handle_reply_to_client(server_sock, client_addr, client_len, BAD_REQUEST, strlen(BAD_REQUEST));
+    // Client's congestion controller tells how fast its share of the path drains (KiB/s)
+    session_set_pacing(client_addr, (uint64_t)ntohl(pacing_rate) * 1024);
+
+    // Bit i of the bitmap (LSB first) asks for chunk first + i. Replies leave at the pacing rate,
+    // chunks past the end of file are ignored
+    uint64_t window = std::min<uint64_t>(bitmap_len * 8, num_chunks - header.chunk_id);
+    uint16_t group_size = std::min<uint16_t>(header.flags, FEC_MAX_GROUP);
+    // A file truncated while served gives a short read: the rest of the batch is dropped
+    if (group_size < 2) {
+        for (uint64_t i = 0; i < window; i++) {
+            if ((bitmap[i / 8] & (1 << (i % 8)))
+                && !send_chunk(worker, client_addr, client_len, header.file_handle, *file, header.chunk_id + i)) {
+                file_changed(header.file_handle);
+                return;
+            }
+        }
         return;
     }
 
-    uint32_t file_size = file_stat.st_size;
-    uint32_t num_chunks = (file_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    // FEC: up to group_size requested chunks within FEC_MAX_GROUP ids of each other share one parity
+    uint64_t group_first = 0;
+    uint16_t members = 0;
+    for (uint64_t i = 0; i <= window; i++) {
+        bool requested = i < window && (bitmap[i / 8] & (1 << (i % 8)));
+        if (members != 0 && (i == window || (requested && (i - group_first >= FEC_MAX_GROUP
+                                                             || __builtin_popcount(members) == group_size)))) {
+            if (!send_chunk_group(worker, client_addr, client_len, header.file_handle, *file, header.chunk_id + group_first, members)) {
+                file_changed(header.file_handle);
+                return;
+            }
+            members = 0;
+        }
+        if (requested) {
+            if (members == 0) {
+                group_first = i;
+            }
+            members |= 1 << (i - group_first);
+        }
+    }
+}
 
-    // If request chunk ID exceeded accepted range
-    if (chunk_index >= num_chunks) {
-        handle_reply_to_client(server_sock, client_addr, client_len, BAD_REQUEST, strlen(BAD_REQUEST));
+/// @brief Read and send one chunk of a file (chunk_index must be in range), false if the file changed
+bool send_chunk(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, uint32_t file_handle, OpenFile& file,
+                uint64_t chunk_index) {
+    if (worker.chunks.size() < file.chunk_size) {
+        worker.chunks.resize(file.chunk_size);
+    }
+    size_t len;
+    if (!file_read_chunk(file, chunk_index, worker.chunks.data(), len)) {
+        return false;
+    }
+    send_chunk_data(worker, client_addr, client_len, file_handle, file, chunk_index, worker.chunks.data(), len);
+    return true;
+}
+
+/// @brief Send one chunk already read (len bytes at data), group_position = place in its FEC group (0 = none)
+void send_chunk_data(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, uint32_t file_handle, OpenFile& file,
+                     uint64_t chunk_index, const char* data, size_t len, uint16_t group_position) {
+    // Compressed when the handle has a codec and the chunk gains enough from it
+    const char* payload = data;
+    size_t payload_len = len;
+    uint16_t flags = group_position;
+    const char* compressed = chunk_compressed(worker, file, chunk_index, payload, payload_len);
+    if (compressed != nullptr) {
+        worker.stats.compressed++;
+        worker.stats.compress_saved += len - payload_len;
+        payload = compressed;
+        flags |= CHUNK_COMPRESSED;
+    }
+
+    handle_reply_to_client(worker, client_addr, client_len, OP_CHUNK, file_handle, chunk_index,
+                           payload, payload_len, flags, group_position == 0);
+}
+
+/// @brief Send one FEC group (see common/fec.h): its parity, then its chunks with their place in the group.
+/// Every member is read before anything is sent, so a file truncated meanwhile sends nothing (false)
+bool send_chunk_group(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, uint32_t file_handle, OpenFile& file,
+                      uint64_t first, uint16_t members) {
+    // A lone chunk gains nothing from a parity
+    if ((members & (members - 1)) == 0) {
+        return send_chunk(worker, client_addr, client_len, file_handle, file, first);
+    }
+
+    // Whole group or nothing: a shed chunk would shift the seqs of the next ones
+    int count = __builtin_popcount(members);
+    if (session_pacing_delay(client_addr) > std::chrono::milliseconds(PACING_MAX_DELAY_MS)) {
+        worker.stats.shed += count;
+        return true;
+    }
+
+    // Member i is read at i * chunk_size
+    uint64_t chunk_size = file.chunk_size;
+    if (worker.chunks.size() < FEC_MAX_GROUP * chunk_size) {
+        worker.chunks.resize(FEC_MAX_GROUP * chunk_size);
+    }
+    size_t lens[FEC_MAX_GROUP];
+    std::vector<char>& parity = worker.parity;
+    size_t parity_len = 0;
+    parity.assign(chunk_size, 0);
+    for (int i = 0; i < FEC_MAX_GROUP; i++) {
+        if (members & (1 << i)) {
+            char* data = worker.chunks.data() + i * chunk_size;
+            if (!file_read_chunk(file, first + i, data, lens[i])) {
+                return false;
+            }
+            fec_xor(parity.data(), data, lens[i]);
+            parity_len = std::max(parity_len, lens[i]);
+        }
+    }
+    handle_reply_to_client(worker, client_addr, client_len, OP_PARITY, file_handle, first,
+                           parity.data(), parity_len, members, false);
+    worker.stats.parity++;
+
+    uint16_t position = 1;
+    for (int i = 0; i < FEC_MAX_GROUP; i++) {
+        if (members & (1 << i)) {
+            send_chunk_data(worker, client_addr, client_len, file_handle, file, first + i,
+                            worker.chunks.data() + i * chunk_size, lens[i], position++);
+        }
+    }
+    return true;
+}
+
+/// @brief Handle hash requests (OP_REQUEST_HASHES, file handle + first leaf): reply with as many leaf hashes
+/// as fit one chunk of the handle, so the reply is no larger than the chunks the client asked for
+void handle_hashes_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header) {
+    std::shared_ptr<OpenFile> file = file_cache_get(header.file_handle);
+
+    // Unknown handle or file do not open
+    if (file == nullptr) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
+        return;
+    }
+    std::shared_ptr<const HashTree> tree = file_hash_tree(header.file_handle, *file);
+    if (tree == nullptr) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);     // Changed since its OP_META
         return;
     }
 
-    // Calculate offset and actual chunk size
-    off_t offset = static_cast<off_t>(chunk_index) * CHUNK_SIZE;
-    size_t actual_chunk_size = (chunk_index == num_chunks - 1) ?
-                               (file_size % CHUNK_SIZE ? file_size % CHUNK_SIZE : CHUNK_SIZE) : CHUNK_SIZE;
+    // If first leaf exceeded accepted range
+    uint64_t num_leaves = tree->leaves.size();
+    if (header.chunk_id >= num_leaves) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
+        return;
+    }
 
-    // Read chunk data from file
-    char chunk_data[CHUNK_SIZE];
-    lseek(fd, offset, SEEK_SET);
-    ssize_t read_len = read(fd, chunk_data, actual_chunk_size);
+    uint64_t count = std::min<uint64_t>(std::max<uint32_t>(1, file->chunk_size / SHA256_SIZE), num_leaves - header.chunk_id);
+    handle_reply_to_client(worker, client_addr, client_len, OP_HASHES, header.file_handle, header.chunk_id,
+                           (const char*)tree->leaves[header.chunk_id].data(), count * SHA256_SIZE);
+}
 
-    // File has been changed or modified (smaller than expect)
-    if (read_len != actual_chunk_size) {
-        handle_reply_to_client(server_sock, client_addr, client_len, BAD_REQUEST, strlen(BAD_REQUEST));
+std::shared_ptr<const HashTree> file_hash_tree(uint32_t file_handle, const OpenFile& file) {
+    // Catalog name: DOWNLOAD_LIST is the only path without a directory
+    std::string name;
+    {
+        std::lock_guard<std::mutex> lock(cache_mtx);
+        name = file_handles[file_handle - 1].fullpath;
+    }
+    name = name.substr(name.rfind('/') + 1);
+    std::shared_ptr<const HashTree> tree = catalog_tree(name, file.chunk_size, file.size, file.mtime);
+    if (tree == nullptr) {
+        catalog_want_chunk_size(file.chunk_size);
+    }
+    return tree;
+}
+
+/// @brief Handle catalog requests (OP_REQUEST_CATALOG, page, payload = chunk size): one page of files with
+/// their metadata, handle and root hash. Pages are filled up to one chunk in name order, so the page
+/// count is known from the first page and the others can be asked for at once. Nothing is opened or hashed
+/// here: trees come from the catalog thread, files without one are left out with CATALOG_PENDING and the
+/// catalog thread is asked to hash them
+void handle_catalog_request(Worker& worker, struct sockaddr_in &client_addr, socklen_t &client_len, PacketHeader& header, char* payload) {
+    uint32_t chunk_size;
+    if (header.length != sizeof(chunk_size)) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
         return;
     }
+    memcpy(&chunk_size, payload, sizeof(chunk_size));
+    chunk_size = chunk_size_allowed(ntohl(chunk_size));
+
+    // Latest published catalog, served from memory (the catalog thread keeps it up to date)
+    std::shared_ptr<CatalogSnapshot> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(catalog_mtx);
+        snapshot = catalog;
+    }
+    const std::vector<CatalogFile>& files = snapshot->files;
+    const std::vector<size_t>& page_starts = catalog_pages(*snapshot, chunk_size);
+    if (header.chunk_id >= page_starts.size()) {
+        handle_error_reply(worker, client_addr, client_len, BAD_REQUEST);
+        return;
+    }
+    size_t first = page_starts[header.chunk_id];
+    size_t last = header.chunk_id + 1 < page_starts.size() ? page_starts[header.chunk_id + 1] : files.size();
+
+    std::vector<char> message(sizeof(CatalogPage));
+    uint32_t entry_count = 0;
+    uint16_t flags = 0;
+    for (size_t i = first; i < last; i++) {
+        char fullpath[MAX_FILE_LENGTH * 2];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", DOWNLOAD_DIR, files[i].name.c_str());
+        uint32_t file_handle = file_handle_get(fullpath, chunk_size, compress_codec(files[i].name.c_str(), header.flags));
+
+        size_t size = files[i].size;
+        struct timespec mtime = files[i].mtime;
+        auto tree = files[i].trees.find(chunk_size);
+        if (tree == files[i].trees.end()) {
+            flags |= CATALOG_PENDING;
+            continue;
+        }
 
-    // Create a reply
-    snprintf(reply_message, sizeof(reply_message), "CHUNK:%s:%lu:", filename, chunk_index);
-    size_t header_len = strlen(reply_message);
-    memcpy(reply_message + header_len, chunk_data, actual_chunk_size);
-    size_t total_len = header_len + actual_chunk_size;
-    handle_reply_to_client(server_sock, client_addr, client_len, reply_message, total_len);
+        CatalogEntry entry;
+        entry.file_handle = htonl(file_handle);
+        entry.file_size = htonll(size);
+        entry.num_chunk = htonll((size + chunk_size - 1) / chunk_size);
+        entry.chunk_size = htonll(chunk_size);
+        entry.version = htonll((uint64_t)mtime.tv_sec * 1000000000 + mtime.tv_nsec);
+        memcpy(entry.root_hash, tree->second->root.data(), SHA256_SIZE);
+        entry.name_len = htons(files[i].name.size());
+        message.insert(message.end(), (char*)&entry, (char*)&entry + sizeof(entry));
+        message.insert(message.end(), files[i].name.begin(), files[i].name.end());
+        entry_count++;
+    }
+
+    CatalogPage page;
+    page.generation = htonll(snapshot->generation);
+    page.page_count = htonl(page_starts.size());
+    page.entry_count = htonl(entry_count);
+    memcpy(message.data(), &page, sizeof(page));
+    if (flags & CATALOG_PENDING) {
+        catalog_want_chunk_size(chunk_size);
+    }
+    handle_reply_to_client(worker, client_addr, client_len, OP_CATALOG, 0, header.chunk_id, message.data(), message.size(), flags);
 }
 
 /** TIMEOUT THREAD **/
-void timeout_checker_thread(int server_sock) {
+void timeout_checker_thread(Worker& worker) {
+    auto resend_batch = std::make_unique<SendBatch>();
+    resend_batch->gso = worker.gso;
+    std::vector<TimerEntry> due;
+
     while(running) {
-        auto now = std::chrono::steady_clock::now();
-        std::vector<uint64_t> to_remove;
-
-        {
-            std::unique_lock<std::mutex> lock(packets_mtx);
-
-            for(auto& [seq_num, packet] : pending_packets) {
-                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    now - packet.send_time);
-
-                if(elapsed.count() > ACK_TIMEOUT) {
-                    if(packet.retry_count < MAX_RETRIES) {
-                        // Resend packet
-                        sendto(server_sock, packet.buffer, packet.buffer_len, 0,
-                               (sockaddr*)&packet.client_addr, sizeof(packet.client_addr));
-
-                        packet.retry_count++;
-                        packet.send_time = now;
-                        // std::cout << "[RETRY] Seq " << seq_num << " (attempt "
-                        //           << packet.retry_count << ")\n";
+        // Every stripe is served by exactly one timeout thread, resends leave from this worker's socket.
+        // The thread then sleeps until the earliest timer of its stripes (or the next idle session sweep)
+        auto wake = std::chrono::steady_clock::now() + std::chrono::milliseconds(SESSION_SWEEP_MS);
+        for (int stripe_id = worker.id; stripe_id < SESSION_STRIPES; stripe_id += worker.num_workers) {
+            SessionStripe& stripe = session_stripes[stripe_id];
+            TimerWheel& wheel = stripe.timer_wheel;
+            auto now = std::chrono::steady_clock::now();
+            uint64_t now_tick = (now - wheel.start) / std::chrono::milliseconds(TIMER_TICK_MS);
+
+            std::lock_guard<std::mutex> lock(stripe.mtx);
+            if (now - stripe.last_sweep >= std::chrono::milliseconds(SESSION_SWEEP_MS)) {
+                session_sweep(stripe, now);
+            }
+
+            // Only timers of elapsed ticks are touched, ticks with none are skipped at once
+            while (wheel.current_tick <= now_tick) {
+                if (wheel.current_tick < wheel.wake_tick) {
+                    wheel.current_tick = std::min(wheel.wake_tick, now_tick + 1);
+                    continue;
+                }
+                due.clear();
+                wheel_advance(stripe, due);
+
+                for (TimerEntry& entry : due) {
+                    PendingPacket* packet = find_pending(stripe, entry.session_key, entry.seq);
+                    if (packet == nullptr) {
+                        continue;
+                    }
+                    Session& session = stripe.sessions.find(entry.session_key)->second;
+
+                    if (packet->paced) {
+                        // Departure time reached: first send, then wait for its ACK
+                        batch_push(worker.sock_fd, *resend_batch, packet->client_addr, packet->buffer.data(), packet->buffer.size());
+
+                        packet->paced = false;
+                        packet->send_time = now;
+                        session.paced_queued--;
+                        wheel_schedule(wheel, *packet, TimerEntry{entry.session_key, entry.seq, wheel_tick(wheel, now + session_rto(session, 0))});
+                    } else if(packet->retry_count < MAX_RETRIES) {
+                        // Queue packet to resend
+                        batch_push(worker.sock_fd, *resend_batch, packet->client_addr, packet->buffer.data(), packet->buffer.size());
+
+                        // Exponential backoff: each resend of this reply waits twice as long
+                        packet->retry_count++;
+                        packet->send_time = now;
+                        worker.stats.retransmitted++;
+                        wheel_schedule(wheel, *packet, TimerEntry{entry.session_key, entry.seq, wheel_tick(wheel, now + session_rto(session, packet->retry_count))});
+                        // std::cout << "[RETRY] Seq " << entry.seq << " (attempt "
+                        //           << packet->retry_count << ")\n";
                     } else {
-                        to_remove.push_back(seq_num);
-                        // std::cout << "[DROP] Seq " << seq_num << " (max retries)\n";
+                        // Remove expired packet
+                        session.pending_packets.erase(entry.seq);
+                        session.last_active = now;
+                        worker.stats.dropped++;
+                        // std::cout << "[DROP] Seq " << entry.seq << " (max retries)\n";
                     }
                 }
+                if (wheel.current_tick > wheel.wake_tick) {
+                    wheel.wake_tick = wheel_next_tick(wheel);
+                }
             }
-
-            // Remove expired packets
-            for(auto seq : to_remove) {
-                pending_packets.erase(seq);
+            if (wheel.wake_tick != UINT64_MAX) {
+                wake = std::min(wake, wheel.start + std::chrono::milliseconds(wheel.wake_tick * TIMER_TICK_MS));
             }
         }
 
-        // Wait with timeout
-        std::unique_lock<std::mutex> lock(packets_mtx);
-        timeout_cv.wait_for(lock, std::chrono::milliseconds(ACK_TIMEOUT), [&]{
-            return !running.load();
+        // Send all paced and timed out packets at once (outside the locks)
+        batch_flush(worker.sock_fd, *resend_batch);
+
+        // A reply that arms an earlier timer meanwhile sets timer_armed: no wakeup is lost
+        std::unique_lock<std::mutex> lock(worker.timeout_mtx);
+        worker.timeout_cv.wait_until(lock, wake, [&]{
+            return !running.load() || worker.timer_armed;
         });
+        worker.timer_armed = false;
+    }
+}
+
+/// @brief Key of the session of a client address
+uint64_t session_key(const sockaddr_in& addr) {
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+/// @brief Stripe holding a session
+SessionStripe& session_stripe(uint64_t key) {
+    // Mix bits so that clients behind the same IP spread over stripes
+    return session_stripes[((key * 0x9E3779B97F4A7C15ULL) >> 32) % SESSION_STRIPES];
+}
+
+/// @brief Set the rate replies to a client are paced at (0 = send at once)
+void session_set_pacing(const sockaddr_in& client_addr, uint64_t pacing_rate) {
+    uint64_t key = session_key(client_addr);
+    SessionStripe& stripe = session_stripe(key);
+    std::lock_guard<std::mutex> lock(stripe.mtx);
+    stripe.sessions[key].pacing_rate = pacing_rate;     // Chunk replies follow: the session is needed anyway
+}
+
+/// @brief How long a new reply to a client would wait for its paced departure
+std::chrono::steady_clock::duration session_pacing_delay(const sockaddr_in& client_addr) {
+    uint64_t key = session_key(client_addr);
+    SessionStripe& stripe = session_stripe(key);
+    std::lock_guard<std::mutex> lock(stripe.mtx);
+    auto it = stripe.sessions.find(key);
+    if (it == stripe.sessions.end() || it->second.pacing_rate == 0) {
+        return std::chrono::steady_clock::duration::zero();
+    }
+    return std::max(std::chrono::steady_clock::duration::zero(), it->second.next_departure - std::chrono::steady_clock::now());
+}
+
+/// @brief Find a pending packet of a session, nullptr if it has been acknowledged. Stripe lock must be held
+PendingPacket* find_pending(SessionStripe& stripe, uint64_t key, uint64_t seq) {
+    auto session_it = stripe.sessions.find(key);
+    if (session_it == stripe.sessions.end()) {
+        return nullptr;
+    }
+    auto it = session_it->second.pending_packets.find(seq);
+    if (it == session_it->second.pending_packets.end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+/// @brief Evict the sessions of a stripe idle for SESSION_IDLE_TIMEOUT with nothing pending, so stray or spoofed
+/// sources do not stay in the table. Nothing pending means no timer refers to them. Stripe lock must be held
+void session_sweep(SessionStripe& stripe, std::chrono::steady_clock::time_point now) {
+    stripe.last_sweep = now;
+    for (auto it = stripe.sessions.begin(); it != stripe.sessions.end(); ) {
+        if (it->second.pending_packets.empty() && now - it->second.last_active > std::chrono::seconds(SESSION_IDLE_TIMEOUT)) {
+            it = stripe.sessions.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+/// @brief Convert a time point to a timer wheel tick (rounded up)
+uint64_t wheel_tick(TimerWheel& wheel, std::chrono::steady_clock::time_point time) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(time - wheel.start).count();
+    return (elapsed + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+/// @brief Put a timer of a pending packet into the wheel. A timer due before the tick its timeout thread
+/// sleeps until wakes that thread (stripe lock held, then the worker's timeout_mtx)
+void wheel_schedule(TimerWheel& wheel, PendingPacket& packet, TimerEntry entry) {
+    // Never schedule in a tick that has already been processed
+    if (entry.deadline < wheel.current_tick) {
+        entry.deadline = wheel.current_tick;
+    }
+
+    uint64_t delta = entry.deadline - wheel.current_tick;
+    std::list<TimerEntry>* slot;
+    uint64_t process_tick = entry.deadline;
+    if (delta < WHEEL_SLOTS) {
+        slot = &wheel.slots[0][entry.deadline % WHEEL_SLOTS];
+    } else {
+        // Far timers wait in level 1 (capped at its range) and are cascaded later
+        uint64_t level_tick = std::min(entry.deadline / WHEEL_SLOTS, wheel.current_tick / WHEEL_SLOTS + WHEEL_SLOTS - 1);
+        slot = &wheel.slots[1][level_tick % WHEEL_SLOTS];
+        process_tick = level_tick * WHEEL_SLOTS;
+    }
+
+    packet.timer_slot = slot;
+    packet.timer_it = slot->insert(slot->end(), entry);
+
+    if (process_tick < wheel.wake_tick) {
+        wheel.wake_tick = process_tick;
+        if (wheel.owner != nullptr) {
+            std::lock_guard<std::mutex> lock(wheel.owner->timeout_mtx);
+            wheel.owner->timer_armed = true;
+            wheel.owner->timeout_cv.notify_one();
+        }
     }
 }
 
+/// @brief First tick with a timer to process (a level 1 timer is processed when its slot is cascaded),
+/// UINT64_MAX if the wheel is empty. Acknowledged timers leave their slot, so only live ones count
+uint64_t wheel_next_tick(const TimerWheel& wheel) {
+    for (uint64_t tick = wheel.current_tick; tick < wheel.current_tick + WHEEL_SLOTS; tick++) {
+        if (!wheel.slots[0][tick % WHEEL_SLOTS].empty()
+            || (tick % WHEEL_SLOTS == 0 && !wheel.slots[1][(tick / WHEEL_SLOTS) % WHEEL_SLOTS].empty())) {
+            return tick;
+        }
+    }
+    for (uint64_t level_tick = wheel.current_tick / WHEEL_SLOTS + 1; level_tick < wheel.current_tick / WHEEL_SLOTS + WHEEL_SLOTS; level_tick++) {
+        if (!wheel.slots[1][level_tick % WHEEL_SLOTS].empty()) {
+            return level_tick * WHEEL_SLOTS;
+        }
+    }
+    return UINT64_MAX;
+}
+
+/// @brief Process one tick of the wheel of a stripe, move its due timers into due
+void wheel_advance(SessionStripe& stripe, std::vector<TimerEntry>& due) {
+    TimerWheel& wheel = stripe.timer_wheel;
+
+    // Level 0 wrapped around: spread the matching level 1 slot over level 0
+    if (wheel.current_tick % WHEEL_SLOTS == 0) {
+        std::list<TimerEntry> cascade;
+        cascade.swap(wheel.slots[1][(wheel.current_tick / WHEEL_SLOTS) % WHEEL_SLOTS]);
+        for (TimerEntry& entry : cascade) {
+            PendingPacket* packet = find_pending(stripe, entry.session_key, entry.seq);
+            if (packet != nullptr) {
+                wheel_schedule(wheel, *packet, entry);
+            }
+        }
+    }
+
+    std::list<TimerEntry>& slot = wheel.slots[0][wheel.current_tick % WHEEL_SLOTS];
+    due.insert(due.end(), slot.begin(), slot.end());
+    slot.clear();
+    wheel.current_tick++;
+}
+
 /** HANDLER FUNCTIONS **/
-void handle_reply_to_client(int server_sock, sockaddr_in &client_addr,
-                            socklen_t &client_len, char* buffer, size_t buffer_len) {
-    std::lock_guard<std::mutex> lock(packets_mtx);
-
-    // Get sequence number
-    auto key = std::make_pair(client_addr.sin_addr.s_addr, client_addr.sin_port);
-    uint64_t& seq_num = connected_device[key];
-    uint64_t current_seq = seq_num++;
-
-    // Build message
-    char message[BUFFER_SIZE];
-    snprintf(message, sizeof(message), "%s:%lu:", REPLY, current_seq);
-    size_t header_len = strlen(message);
-    memcpy(message + header_len, buffer, buffer_len);
-    size_t total_len = header_len + buffer_len;
-    encode_and_push_back(message, total_len);
-
-    // Save to pending
-    PendingPacket packet {
-        .send_time = std::chrono::steady_clock::now(),
-        .retry_count = 0,
-        .buffer_len = total_len,
-        .client_addr = client_addr
-    };
-    memcpy(packet.buffer, message, total_len);
+void handle_reply_to_client(Worker& worker, sockaddr_in &client_addr, socklen_t &client_len,
+                            uint8_t opcode, uint32_t file_handle, uint64_t chunk_id, const char* payload, size_t payload_len,
+                            uint16_t flags, bool may_shed) {
+    uint64_t key = session_key(client_addr);
+    SessionStripe& stripe = session_stripe(key);
+    std::lock_guard<std::mutex> lock(stripe.mtx);
+
+    Session& session = stripe.sessions[key];      // A reply starts the session
+    auto now = std::chrono::steady_clock::now();
+    session.last_active = now;
+    size_t packet_len = sizeof(PacketHeader) + payload_len;
+
+    // Pacing: replies leave one every size / rate, whatever arrives within one tick goes out at once
+    auto departure = now;
+    if (session.pacing_rate > 0) {
+        departure = std::max(now, session.next_departure);
+
+        // Chunks that would wait longer than PACING_MAX_DELAY_MS are dropped (the client asks again
+        // and takes it as congestion) instead of queueing ever later replies
+        if (may_shed && opcode == OP_CHUNK && departure - now > std::chrono::milliseconds(PACING_MAX_DELAY_MS)) {
+            worker.stats.shed++;
+            return;
+        }
+        session.next_departure = departure + std::chrono::nanoseconds(packet_len * 1000000000ULL / session.pacing_rate);
+    }
+
+    // Get sequence number of this client
+    uint64_t current_seq = session.next_seq++;
+
+    // Save to pending, build message directly in it
+    auto [it, inserted] = session.pending_packets.try_emplace(current_seq);
+    PendingPacket& packet = it->second;
+    if (!inserted) {
+        packet.timer_slot->erase(packet.timer_it);    // Replaced packet must not keep its timer
+        session.paced_queued -= packet.paced;
+    }
+    packet.send_time = now;
+    packet.retry_count = 0;
+    packet.client_addr = client_addr;
+    packet.buffer.resize(packet_len);
+    build_packet(packet.buffer.data(), opcode, file_handle, chunk_id, current_seq, payload, payload_len, flags);
+    worker.stats.sent++;
+
+    // Replies leave in seq order: once one waits, the next ones wait behind it (no false SACK holes)
+    TimerWheel& wheel = stripe.timer_wheel;
+    packet.paced = session.paced_queued > 0 || departure - now >= std::chrono::milliseconds(TIMER_TICK_MS);
+    if (packet.paced) {
+        // Sent by the timeout thread when its departure tick is processed
+        wheel_schedule(wheel, packet, TimerEntry{key, current_seq, wheel_tick(wheel, departure)});
+        session.paced_queued++;
+        worker.stats.paced++;
+        return;
+    }
+
+    // Start retransmission timer
+    wheel_schedule(wheel, packet, TimerEntry{key, current_seq, wheel_tick(wheel, now + session_rto(session, 0))});
 
-    pending_packets[current_seq] = packet;
-    
-    // Initial send
-    sendto(server_sock, message, total_len, 0,
-           (sockaddr*)&client_addr, client_len);
+    // Initial send (flushed at the end of the receive round)
+    batch_push(worker.sock_fd, *worker.send_batch, client_addr, packet.buffer.data(), packet.buffer.size());
 
     // std::cout << "[SEND] Seq " << current_seq << " to "
     //           << inet_ntoa(client_addr.sin_addr) << "\n";
-    timeout_cv.notify_one();
 }
 
-void handle_reply_from_client(int server_sock, sockaddr_in &client_addr,
-                                    socklen_t &client_len, char* buffer, size_t buffer_len) {
-    char* seq_start = strchr(buffer, ':') + 1;
-    uint64_t seq_num = std::stoull(seq_start);
+/// @brief Send a reply once, without a session or a seq (seq = NO_SEQ): a junk or spoofed request costs one
+/// datagram and leaves nothing behind (the client asks again if it is lost)
+void handle_unsequenced_reply(Worker& worker, sockaddr_in &client_addr, uint8_t opcode, uint32_t file_handle,
+                              const char* payload, size_t payload_len, uint16_t flags) {
+    char packet[sizeof(PacketHeader) + sizeof(Metadata) + MAX_FILE_LENGTH];
+    size_t packet_len = build_packet(packet, opcode, file_handle, 0, NO_SEQ, payload,
+                                     std::min(payload_len, sizeof(packet) - sizeof(PacketHeader)), flags);
+    batch_push(worker.sock_fd, *worker.send_batch, client_addr, packet, packet_len);
+    worker.stats.sent++;
+}
 
-    std::lock_guard<std::mutex> lock(packets_mtx);
-    if(pending_packets.erase(seq_num)) {
-        // std::cout << "[ACK] Seq " << seq_num << " from "
-        //           << inet_ntoa(client_addr.sin_addr) << "\n";
-    }
+/// @brief Send an OP_ERROR reply to client, once (see handle_unsequenced_reply)
+void handle_error_reply(Worker& worker, sockaddr_in &client_addr, socklen_t &client_len, char* message) {
+    handle_unsequenced_reply(worker, client_addr, OP_ERROR, 0, message, strlen(message));
 }
 
-/// @brief create CRC32 looking table using 0xEDB88320 polynomial
-void init_crc_table() {
-    uint32_t polynomial = 0xEDB88320;
-    for (uint32_t i = 0; i < 256; i++) {
-        uint32_t c = i;
-        for (size_t j = 0; j < 8; j++) {
-            if (c & 1)
-                c = polynomial ^ (c >> 1);
-            else
-                c = c >> 1;
+/// @brief Handle ACK from client (OP_ACK, seq = cumulative ACK, payload = SACK bitmap)
+void handle_reply_from_client(Worker& worker, sockaddr_in &client_addr,
+                                    socklen_t &client_len, PacketHeader& header, char* payload) {
+    if (header.length > SACK_BITMAP_BYTES) {
+        return;
+    }
+
+    uint64_t key = session_key(client_addr);
+    SessionStripe& stripe = session_stripe(key);
+    std::lock_guard<std::mutex> lock(stripe.mtx);
+
+    auto session_it = stripe.sessions.find(key);
+    if (session_it == stripe.sessions.end()) {
+        return;
+    }
+    auto& pending_packets = session_it->second.pending_packets;
+
+    // Acknowledge one reply and cancel its retransmission timer. The latest reply sent only once gives
+    // the RTT sample (Karn: a resent reply can not tell which copy was acknowledged)
+    std::chrono::steady_clock::time_point latest_sacked_send{};
+    std::chrono::steady_clock::time_point latest_sample_send{};
+    auto acknowledge = [&](std::map<uint64_t, PendingPacket>::iterator it) {
+        if (it->second.paced) {
+            session_it->second.paced_queued--;     // Given up by the client before it left
+        } else if (it->second.retry_count == 0) {
+            latest_sample_send = std::max(latest_sample_send, it->second.send_time);
         }
-        crc_table[i] = c;
+        it->second.timer_slot->erase(it->second.timer_it);
+        worker.stats.acked++;
+        return pending_packets.erase(it);
+    };
+
+    // Cumulative part: every seq below header.seq
+    auto it = pending_packets.begin();
+    while (it != pending_packets.end() && it->first < header.seq) {
+        it = acknowledge(it);
     }
-}
 
-/// @brief calculate crc32 checksum for a string data
-uint32_t crc32(char* buf, size_t len) {
-    uint32_t crc = 0xFFFFFFFF;
-    for (size_t i = 0; i < len; i++) {
-        uint8_t index = (crc ^ (uint8_t)buf[i]) & 0xFF;
-        crc = crc_table[index] ^ (crc >> 8);
+    // SACK part: bit i (LSB first) => seq header.seq + 1 + i
+    uint64_t highest_sacked = 0;
+    for (uint64_t i = 0; i < (uint64_t)header.length * 8; i++) {
+        if (payload[i / 8] & (1 << (i % 8))) {
+            highest_sacked = header.seq + 1 + i;
+            auto sacked = pending_packets.find(highest_sacked);
+            if (sacked != pending_packets.end()) {
+                latest_sacked_send = std::max(latest_sacked_send, sacked->second.send_time);
+                acknowledge(sacked);
+            }
+        }
+    }
+
+    Session& session = session_it->second;
+    auto now = std::chrono::steady_clock::now();
+    session.last_active = now;
+    if (latest_sample_send != std::chrono::steady_clock::time_point{}) {
+        session.rtt.sample(std::chrono::duration<double, std::milli>(now - latest_sample_send).count());
     }
-    return crc ^ 0xFFFFFFFF;
+
+    // Replies passed by SACK_DUP_THRESH SACKed ones, and sent REORDER_WINDOW_MS before the latest
+    // SACKed one (paced and immediate replies leave from different threads), are lost: resend them
+    // once without waiting for their timer (later losses of the same reply are left to the timer)
+    if (highest_sacked < header.seq + SACK_DUP_THRESH) {
+        return;
+    }
+    TimerWheel& wheel = stripe.timer_wheel;
+    for (it = pending_packets.begin(); it != pending_packets.end() && it->first <= highest_sacked - SACK_DUP_THRESH; it++) {
+        PendingPacket& packet = it->second;
+        if (packet.paced || packet.retry_count > 0
+            || packet.send_time + std::chrono::milliseconds(REORDER_WINDOW_MS) > latest_sacked_send) {
+            continue;
+        }
+        batch_push(worker.sock_fd, *worker.send_batch, packet.client_addr, packet.buffer.data(), packet.buffer.size());
+        packet.retry_count++;
+        packet.send_time = now;
+        packet.timer_slot->erase(packet.timer_it);
+        wheel_schedule(wheel, packet, TimerEntry{key, it->first, wheel_tick(wheel, now + session_rto(session, packet.retry_count))});
+        worker.stats.fast_retransmitted++;
+    }
+}
+
+/// @brief Build a datagram (header + payload) into message, return its total length
+size_t build_packet(char* message, uint8_t opcode, uint32_t file_handle, uint64_t chunk_id, uint64_t seq,
+                    const char* payload, size_t payload_len, uint16_t flags) {
+    PacketHeader header;
+    header.version = PROTOCOL_VERSION;
+    header.opcode = opcode;
+    header.flags = htons(flags);
+    header.file_handle = htonl(file_handle);
+    header.chunk_id = htonll(chunk_id);
+    header.seq = htonll(seq);
+    header.length = htonl(payload_len);
+    header.crc = 0;
+
+    memcpy(message, &header, sizeof(header));
+    memcpy(message + sizeof(header), payload, payload_len);
+    size_t total_len = sizeof(header) + payload_len;
+
+    uint32_t crc = htonl(crc32(message, total_len));
+    memcpy(message + offsetof(PacketHeader, crc), &crc, sizeof(crc));
+    return total_len;
 }
 
-/// @brief encode the message/data/buffer to 4-byte checksum and add to the message
-void encode_and_push_back(char* message, size_t& len) {
-    uint32_t crc = htonl(crc32(message, len));
-    memcpy(message + len, &crc, sizeof(crc));
-    len += sizeof(crc);
-    //std::cerr << "CRC32 code: " << crc << "\n";
-}
\ No newline at end of file
+/// @brief Check version, length and CRC of a datagram, fill header in host order. Return false if it must be dropped
+bool parse_packet(char* message, size_t len, PacketHeader& header) {
+    if (len < sizeof(PacketHeader)) {
+        return false;
+    }
+    memcpy(&header, message, sizeof(header));
+    if (header.version != PROTOCOL_VERSION || sizeof(header) + ntohl(header.length) != len) {
+        return false;
+    }
+
+    // CRC is computed with its own field zeroed
+    uint32_t crc_received = ntohl(header.crc);
+    memset(message + offsetof(PacketHeader, crc), 0, sizeof(header.crc));
+    if (crc32(message, len) != crc_received) {
+        return false;
+    }
+
+    header.flags = ntohs(header.flags);
+    header.file_handle = ntohl(header.file_handle);
+    header.chunk_id = ntohll(header.chunk_id);
+    header.seq = ntohll(header.seq);
+    header.length = ntohl(header.length);
+    return true;
+}
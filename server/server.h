@@ -1,46 +1,151 @@
 /*
-System test:
-REQUEST_METADATA:_serverlist.svl
-REQUEST_CHUNK:_serverlist.svl:0
-REQUEST_CHUNK:_serverlist.svl:10
-REQUEST_METADATA:filename
-ssss
-REQUEST_CHUNK:hi:
-REQUEST_CHUNK:_serverlist.svl
-REQUEST_CHUNK::
-REQUEST_CHUNK:1MB.txt:5
-REQUEST_METADATA:1MB.txt
+System test (opcode, file handle, chunk id | payload):
+OP_REQUEST_METADATA, 0, 0 | 0 "server_files.txt"
+OP_REQUEST_CHUNK, <handle of server_files.txt>, 0
+OP_REQUEST_CHUNK, <handle of server_files.txt>, 10
+OP_REQUEST_METADATA, 0, 0 | 0 "filename"
+OP_REQUEST_METADATA, 0, 0 | 0 ""
+OP_REQUEST_METADATA, 0, 0 | 0 "../server/server.cpp" => error (names with a / are refused)
+OP_REQUEST_METADATA, 0, 0 | 0 "server_files.txt.bak" => error (not the list: looked for in DOWNLOAD_DIR)
+OP_REQUEST_METADATA, 0, 0 | 100000 "1MB.txt" => chunk size clamped to MAX_CHUNK_SIZE
+OP_REQUEST_METADATA, 0, 0 | 1000 "1MB.txt" => chunk size 512 (rounded down to an allowed size), 1440 stays 1440
+OP_REQUEST_CHUNK, 12345, 0
+OP_REQUEST_CHUNK, 0, 0
+OP_REQUEST_METADATA, 0, 0 | 0 "1MB.txt" => OP_META flags META_PENDING the first time for this chunk size (hashed in the background)
+OP_REQUEST_METADATA, 0, 0, flags 1 | 0 "1MB.txt" => OP_META flags 1, another handle: its chunks come compressed (OP_CHUNK flags 0x8000)
+OP_REQUEST_METADATA, 0, 0, flags 1 | 0 "lalala.zip" => OP_META flags 0, chunks raw (already compressed)
+OP_REQUEST_CHUNK, <handle of 1MB.txt>, 5
+OP_REQUEST_CHUNKS, <handle of 1MB.txt>, 0 | 0 0xFF 0x01 => chunks 0..8
+OP_REQUEST_CHUNKS, <handle of 1MB.txt>, 50 | 0 0xFF => chunks 50..57, past the end ignored
+OP_REQUEST_CHUNKS, <handle of 1MB.txt>, 0 | 100 0xFF => chunks 0..7 spread over ~80 ms
+OP_REQUEST_CHUNKS, <handle of 1MB.txt>, 0, flags 4 | 0 0xFF 0x01 => OP_PARITY 0..3, chunks 0..3, OP_PARITY 4..7, chunks 4..7, chunk 8
+OP_ACK, 0, 0, seq 10 | 0x05 => replies 0..9, 11 and 13 acknowledged
+OP_REQUEST_HASHES, <handle of 1MB.txt>, 0 => OP_HASHES, leaves 0..(chunk size / 32 - 1), past the end ignored
+OP_REQUEST_HASHES, <handle of 1MB.txt>, 100000 => error
+OP_REQUEST_CATALOG, 0, 0 | 1400 => OP_CATALOG page 0 of n, files in name order with handles for 1400-byte chunks
+                                    (flags 1 and no files the first time: hashed for 1400 in the background, ask again)
+OP_REQUEST_CATALOG, 0, 1000 | 0 => error
+Wrong version / wrong CRC / short datagram => dropped
 */
 
-/** COMMANDS **/
-#define REQUEST_METADATA "REQUEST_METADATA"    // Structure: REQUEST_METADATA:filename
-#define REQUEST_CHUNK "REQUEST_CHUNK"          // Structure: REQUEST_CHUNK:filename:chunk_id
-
+/** WIRE PROTOCOL **/
 /*
-Structure: REPLY:Seq#:Command
-Including:
-Server -> Client
-- REPLY:0:CHUNK:filename:id:data
-- REPLY:0:META:filename:data
-- REPLY:0:ERROR:BAD REQUEST
+Every datagram = PacketHeader (network order) + payload of header.length bytes.
+header.crc is the CRC32 of the whole datagram computed with header.crc = 0.
 
 Client -> Server
-- REPLY:0:ACK
+- OP_REQUEST_METADATA: payload = requested chunk size (uint32, 0 = CHUNK_SIZE, rounded down to a power of two,
+                       the largest payload of one of CHUNK_SIZE_MTUS or MAX_CHUNK_SIZE) + filename,
+                       flags = codecs the client can decompress (COMPRESS_*)
+- OP_REQUEST_CHUNK:    file_handle, chunk_id
+- OP_REQUEST_CHUNKS:   file_handle, chunk_id = first chunk, payload = pacing rate (uint32 KiB/s, 0 = none)
+                       + bitmap (bit i, LSB first => chunk_id + i), flags = FEC group size (0 = no parity)
+- OP_REQUEST_HASHES:   file_handle, chunk_id = first leaf of the hash tree
+- OP_REQUEST_CATALOG:  chunk_id = page, payload = chunk size the handles are for (uint32, 0 = CHUNK_SIZE),
+                       flags = codecs, as for OP_REQUEST_METADATA
+- OP_ACK:              seq = cumulative ACK (every reply seq below is received),
+                       payload = SACK bitmap (bit i, LSB first => seq + 1 + i received), at most SACK_BITMAP_BYTES
+
+Server -> Client (every reply has its own seq and is resent until ACK, paced at the last rate asked,
+                  except OP_ERROR and pending OP_META: sent once with seq = NO_SEQ, never acknowledged)
+- OP_META:  file_handle (bound to the negotiated chunk size and codec), payload = Metadata (with the root hash) + filename,
+            flags = codec chunks of the handle may be compressed with (0 = none: not asked for, or already compressed content),
+            or META_PENDING (seq = NO_SEQ, Metadata all 0) while the catalog thread has not hashed the file for the chunk size
+- OP_CHUNK: file_handle, chunk_id, payload = chunk data (compressed with the codec of the handle if CHUNK_COMPRESSED),
+            flags = CHUNK_COMPRESSED | place in its FEC group (1..n, 0 = none)
+- OP_PARITY: file_handle, chunk_id = first chunk of the group, flags = members (bit i => chunk_id + i),
+            payload = XOR of the uncompressed members (shorter ones padded with zeros). Sent just before them:
+            member at place j has the seq of the parity + j
+- OP_HASHES: file_handle, chunk_id = first leaf, payload = consecutive leaf hashes (SHA-256 of 0x00 + chunk),
+            as many as fit one chunk (see common/merkle.h)
+- OP_CATALOG: chunk_id = page, payload = CatalogPage + entries (CatalogEntry + name), at most one chunk:
+            what OP_META gives for each file of DOWNLOAD_DIR, plus its version (mtime),
+            flags = CATALOG_PENDING if files of the page are left out until their hash tree is built
+- OP_ERROR: seq = NO_SEQ, payload = error message
 */
-#define REPLY "REPLY"
-char BAD_REQUEST[] = "ERROR:BAD REQUEST\0";
-char INTERNAL_ERROR[] = "ERROR:Internal server error\0";
+#define PROTOCOL_VERSION 6
+
+#define OP_REQUEST_METADATA 1
+#define OP_REQUEST_CHUNK 2
+#define OP_META 3
+#define OP_CHUNK 4
+#define OP_ACK 5
+#define OP_ERROR 6
+#define OP_REQUEST_CHUNKS 7
+#define OP_REQUEST_HASHES 8
+#define OP_HASHES 9
+#define OP_REQUEST_CATALOG 10
+#define OP_CATALOG 11
+#define OP_PARITY 12
+
+#define COMPRESS_LZ4 0x0001         // Codec: LZ4 block format (common/lz4.h)
+#define CHUNK_COMPRESSED 0x8000     // OP_CHUNK flags: payload is compressed
+#define CATALOG_PENDING 0x0001      // OP_CATALOG flags: files left out until hashed for this chunk size
+#define META_PENDING 0x4000         // OP_META flags: file not hashed yet for this chunk size, no metadata: ask again later
+#define NO_SEQ UINT64_MAX           // Seq of replies sent once without a session (OP_ERROR, pending OP_META), not acknowledged
+
+#pragma pack(push, 1)         // No padding activated
+/// @brief Fixed-size header at the start of every datagram
+struct PacketHeader {
+    uint8_t version;         // PROTOCOL_VERSION
+    uint8_t opcode;          // OP_*
+    uint16_t flags;          // Codecs / FEC group size / place / members (see each opcode)
+    uint32_t file_handle;    // Handle given by OP_META, 0 = none
+    uint64_t chunk_id;       // Chunk index for chunk packets
+    uint64_t seq;            // Reply sequence number (acknowledged by OP_ACK)
+    uint32_t length;         // Payload length
+    uint32_t crc;            // CRC32 of header (with crc = 0) + payload
+};
+#pragma pack(pop)             // Release padding (normal mode)
+
+char BAD_REQUEST[] = "BAD REQUEST";
+char INTERNAL_ERROR[] = "Internal server error";
 
 /** DEFINITIONS **/
 #define SERVER_PORT 12345
+#define NUM_WORKERS 1               // Default worker count, 0 = one per CPU core (override: ./server N)
+#define STATS_INTERVAL 10           // seconds between worker stats reports
 #define BUFFER_SIZE 4096
 #define MAX_FILE 100
-#define RELOAD_INTERVAL 5 // seconds
-#define CHUNK_SIZE 1024
+#define CHUNK_SIZE 1024             // Default chunk size (client asks for 0)
+#define MIN_CHUNK_SIZE 512
+#define CHUNK_SIZE_MTUS {1280, 1492, 1500, 9000}   // Path MTUs whose largest payload is an allowed chunk size (besides powers of two)
+#define MAX_PACKET_SIZE 65507       // Largest UDP payload over IPv4
+#define MAX_CHUNK_SIZE (MAX_PACKET_SIZE - (int)sizeof(PacketHeader))
+#define MAX_BATCH_CHUNKS 1024       // Largest window of one OP_REQUEST_CHUNKS bitmap
 #define MAX_FILE_LENGTH 256
 #define DOWNLOAD_DIR "files/"
 #define DOWNLOAD_LIST "server_files.txt"
+#define RECV_BATCH 64               // Datagrams read per recvmmsg call
+#define SEND_BATCH 64               // Messages written per sendmmsg call
+#define SEND_BATCH_BYTES (1 << 20)  // Bytes queued before a sendmmsg call
+#define GSO_MAX_SEGMENTS 64         // Datagrams merged in one UDP_SEGMENT message (kernel limit)
+#define GSO_MAX_BYTES 65000         // Size of one UDP_SEGMENT message
+#define MAX_OPEN_FILES 64           // Files kept opened for chunk serving
+#define CACHE_REVALIDATE_MS 1000    // How often a cached file is checked for size/mtime change
+#define HASH_THREADS 0              // Threads the catalog thread hashes a file with, 0 = one per CPU core
+#define CATALOG_DEBOUNCE_MS 50      // Longest a change of DOWNLOAD_DIR waits to be published (a burst makes one generation)
+#define CATALOG_RESCAN_INTERVAL 5   // seconds between full rescans of DOWNLOAD_DIR when inotify is not available
+#define CATALOG_CHUNK_SIZES 4       // Chunk sizes the catalog thread keeps hash trees for (the latest asked in catalog requests)
+#define COMPRESS_MAX_RATIO 0.9      // A chunk is sent compressed only if that leaves at most this much of it
+#define COMPRESS_PROBE_CHUNKS 16    // Chunks of a file tried without any gain before the rest is sent raw
+#define COMPRESS_CACHE_BYTES (256 << 20)    // Compressed chunks kept for the next requests (all files)
+#define INCOMPRESSIBLE_EXTENSIONS ".zip .gz .tgz .bz2 .xz .zst .7z .rar .jpg .jpeg .png .gif .webp .mp3 .mp4 .mkv .mov .avi .webm"
 
 
-#define MAX_RETRIES 3
-#define ACK_TIMEOUT 200 // milliseconds
\ No newline at end of file
+#define SACK_BITMAP_BYTES 128       // Largest SACK bitmap of one OP_ACK (1024 replies)
+#define SACK_DUP_THRESH 3           // SACKed replies above a missing one before it is resent at once
+#define REORDER_WINDOW_MS 2         // ... and how much earlier than the latest SACKed reply it must have been sent
+#define MAX_RETRIES 6               // Resends of one reply (RTO doubled each time) before it is given up
+#define ACK_TIMEOUT 200             // milliseconds, RTO of a session before its first RTT sample
+#define MIN_RTO_MS 200              // Floor of the RTO, like TCP: a client stalled by its disk is not a loss (SACK covers LAN losses)
+#define MAX_RTO_MS 4000
+#define PEER_ACK_DELAY_MS 5         // Longest a client holds an ACK back (its DELAYED_ACK_MS), added to the RTO
+#define TIMER_TICK_MS 1             // Resolution of the retransmission/pacing timer wheel
+#define PACING_MAX_DELAY_MS 100     // Longest a chunk may wait for its paced departure
+#define FEC_MAX_GROUP 16            // Largest FEC group: its members must fit the 16-bit flags of OP_PARITY
+#define WHEEL_SLOTS 256             // Slots per wheel level (level 0 covers WHEEL_SLOTS ticks)
+#define WHEEL_LEVELS 2
+#define SESSION_STRIPES 64          // Locks the session table is split into
+#define SESSION_IDLE_TIMEOUT 60     // seconds a session with nothing pending is kept (a new one restarts at seq 0)
+#define SESSION_SWEEP_MS 1000       // How often the timeout threads look for idle sessions